@@ -0,0 +1,80 @@
+#ifndef OPGRID_AFFINITY_H
+#define OPGRID_AFFINITY_H
+
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Thread and memory placement without libnuma: the node of a cpu comes
+// from sysfs and memory is bound with the raw mbind syscall.
+
+#define MAX_NUMA_NODES__ (1024)
+
+// NUMA node of cpu, 0 when the kernel does not tell.
+static inline int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent* e;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* d = opendir(path);
+    if (!d)
+        return 0;
+    while ((e = readdir(d)) != NULL) {
+        if (!strncmp(e->d_name, "node", 4) && isdigit((unsigned char)e->d_name[4])) {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+// Whether the process may run on cpu at all.
+static inline bool cpu_allowed(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return false;
+    return CPU_ISSET(cpu, &set);
+}
+
+// Pins the calling thread to cpu.
+static inline bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Prefers node for the pages of [addr, addr + len) that are not touched
+// yet; addr must be page aligned. Best effort, false where the kernel has
+// no NUMA support.
+static inline bool bind_to_node(void* addr, size_t len, int node)
+{
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long mask[MAX_NUMA_NODES__ / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= MAX_NUMA_NODES__)
+        return false;
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1UL << (node % bits);
+    // MPOL_PREFERRED: fall back to other nodes rather than fail
+    return syscall(SYS_mbind, addr, len, 1, mask, MAX_NUMA_NODES__ + 1, 0) == 0;
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef OPGRID_BYTERING_H
+#define OPGRID_BYTERING_H
+
+#include "ringbuf.h"
+
+// Companion to ring_buffer_t for variable-length records. Records are
+// stored back to back as a length prefix and payload rounded up to 8
+// bytes; one that would cross the end of the buffer is preceded by a pad
+// record covering the tail, so every payload is contiguous.
+// Offsets count bytes and only grow. A processor cursor is the offset of
+// the first byte the processor still uses, so publishers gate on the
+// slowest of them; processors see every record published after they
+// register.
+template<int processor_capacity, int cache_line_size = 64, int page_size = 4096,
+        producer_mode_t producer_mode = multi_producer, class wait_strategy = timed_wait_t<> >
+struct byte_ring_t : aligned_new<cache_line_size> {
+    struct count_t {
+        uint_fast64_t count;
+        uint8_t __padding[cache_line_padded_size(sizeof(uint_fast64_t), cache_line_size)];
+    } __attribute__((aligned(cache_line_size)));
+
+    struct cursor_t {
+        uint_fast64_t offset;
+        uint8_t __padding[cache_line_padded_size(sizeof(uint_fast64_t), cache_line_size)];
+    } __attribute__((aligned(cache_line_size)));
+
+    struct record_t {
+        uint32_t len;       // payload bytes
+        uint32_t pad;       // set on the filler before a wrap
+        uint8_t data[0];
+    };
+
+    // what a publisher holds between claim and commit
+    struct claim_t {
+        uint_fast64_t start;
+        uint_fast64_t end;
+    };
+
+    // buf_size is in bytes and must be a power of two. numa_node and the
+    // std::bad_alloc on failure are as for ring_buffer_t.
+    byte_ring_t(int buf_size = 1 << 16, int numa_node = -1) :
+            impl_(NULL), buf_size_(buf_size), map_size_(0)
+    {
+        const size_t total_size = sizeof(_impl_t) + (size_t)buf_size;
+        const size_t alloc_size = (total_size + page_size - 1) & ~(size_t)(page_size - 1);
+        if (numa_node >= 0) {
+            void* p = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+            impl_ = (_impl_t*)p;
+            map_size_ = alloc_size;
+            bind_to_node(impl_, map_size_, numa_node);
+        } else {
+            impl_ = (_impl_t*)aligned_alloc(page_size, alloc_size);
+            if (!impl_)
+                throw std::bad_alloc();
+        }
+        memset(impl_, 0, sizeof(_impl_t));
+        for (unsigned int n = 0; n < processor_capacity; ++n)
+        impl_->processor_cursors[n].offset = VACANT__;
+        __atomic_store_n(&impl_->reduced_size.count, buf_size - 1, __ATOMIC_SEQ_CST);
+    }
+
+    ~byte_ring_t()
+    {
+        if (map_size_)
+            munmap(impl_, map_size_);
+        else
+            free(impl_);
+    }
+
+    // The largest payload a single record can carry.
+    uint32_t max_record() const
+    {
+        return buf_size_ / 2 - sizeof(record_t);
+    }
+
+    // Takes a free processor slot, or fails at once when all of them are
+    // in use. The processor gets every record published after this returns;
+    // first is the offset of the first one.
+    bool processor_try_register(count_t& processor_number, uint_fast64_t& first)
+    {
+        for (unsigned int n = 0; n < processor_capacity; ++n) {
+            uint_fast64_t vacant = VACANT__;
+
+            if (__atomic_compare_exchange_n(&impl_->processor_cursors[n].offset, &vacant,
+                            __atomic_load_n(&impl_->committed.offset, __ATOMIC_SEQ_CST),
+                            0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                // a publisher that scanned before the slot was taken
+                // gated on no more than what is committed now
+                first = __atomic_load_n(&impl_->committed.offset, __ATOMIC_SEQ_CST);
+                __atomic_store_n(&impl_->processor_cursors[n].offset, first, __ATOMIC_RELEASE);
+                processor_number.count = n;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Waits for a free slot instead.
+    uint_fast64_t processor_register(count_t& processor_number)
+    {
+        uint_fast64_t first;
+
+        if (!processor_try_register(processor_number, first))
+            wait_.wait_until([&]() {
+                return processor_try_register(processor_number, first);
+            });
+        return first;
+    }
+
+    void processor_unregister(count_t& processor_number)
+    {
+        __atomic_store_n(&impl_->processor_cursors[processor_number.count].offset, VACANT__,
+                __ATOMIC_RELEASE);
+        wait_.signal();
+    }
+
+    // Waits until something past offset is published and returns the end
+    // of what is.
+    uint_fast64_t processor_wait_blocking(uint_fast64_t offset)
+    {
+        if (offset >= __atomic_load_n(&impl_->committed.offset, __ATOMIC_RELAXED))
+            wait_.wait_until([&]() {
+                return offset < __atomic_load_n(&impl_->committed.offset, __ATOMIC_RELAXED);
+            });
+        return __atomic_load_n(&impl_->committed.offset, __ATOMIC_ACQUIRE);
+    }
+
+    bool processor_wait_nonblocking(uint_fast64_t offset, uint_fast64_t& end)
+    {
+        end = __atomic_load_n(&impl_->committed.offset, __ATOMIC_ACQUIRE);
+        return offset < end;
+    }
+
+    // The record at offset, stepping over wrap padding; offset moves past it.
+    const record_t* processor_next_record(uint_fast64_t& offset)
+    {
+        const record_t* r = _record(offset);
+
+        if (r->pad) {
+            offset += r->len;
+            r = _record(offset);
+        }
+        offset += _footprint(r->len);
+        return r;
+    }
+
+    // Everything before offset may be overwritten from now on.
+    void processor_release(count_t& processor_number, uint_fast64_t offset)
+    {
+        __atomic_store_n(&impl_->processor_cursors[processor_number.count].offset, offset,
+                __ATOMIC_RELEASE);
+        wait_.signal();
+    }
+
+    // Claims a record of len payload bytes and returns the payload to fill
+    // in before publisher_commit_blocking(). NULL if len > max_record().
+    uint8_t* publisher_claim_blocking(claim_t& claim, uint32_t len)
+    {
+        if (UNLIKELY__(len > max_record()))
+            return NULL;
+
+        const uint_fast64_t footprint = _footprint(len);
+        uint_fast64_t start = __atomic_load_n(&impl_->write.offset, __ATOMIC_RELAXED);
+        uint_fast64_t tail;
+
+        do {
+            tail = buf_size_ - (impl_->reduced_size.count & start);
+            if (tail >= footprint)
+                tail = 0;
+            if (producer_mode == single_producer) {
+                __atomic_store_n(&impl_->write.offset, start + tail + footprint, __ATOMIC_RELAXED);
+                break;
+            }
+        } while (!__atomic_compare_exchange_n(&impl_->write.offset, &start, start + tail + footprint,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        claim.start = start;
+        claim.end = start + tail + footprint;
+        if (UNLIKELY__(!_gate_open(claim.end)))
+            wait_.wait_until([&]() { return _gate_open(claim.end); });
+
+        if (tail) {
+            record_t* pad = _record(start);
+            pad->len = tail;
+            pad->pad = 1;
+        }
+        record_t* r = _record(start + tail);
+        r->len = len;
+        r->pad = 0;
+        return r->data;
+    }
+
+    // Publishes the claim after every claim made before it.
+    void publisher_commit_blocking(claim_t& claim)
+    {
+        if (producer_mode == multi_producer) {
+            if (__atomic_load_n(&impl_->committed.offset, __ATOMIC_RELAXED) != claim.start)
+                wait_.wait_until([&]() {
+                    return __atomic_load_n(&impl_->committed.offset, __ATOMIC_RELAXED) == claim.start;
+                });
+        }
+
+        __atomic_store_n(&impl_->committed.offset, claim.end, __ATOMIC_RELEASE);
+        wait_.signal();
+    }
+
+private:
+    static uint_fast64_t _footprint(uint32_t len)
+    {
+        return (sizeof(record_t) + len + 7) & ~(uint_fast64_t)7;
+    }
+
+    record_t* _record(uint_fast64_t offset)
+    {
+        return (record_t*)&impl_->buffer[impl_->reduced_size.count & offset];
+    }
+
+    // Like ring_buffer_t::_gate_open(), except that with no processor
+    // registered the publishers still must not lap uncommitted records.
+    bool _gate_open(uint_fast64_t end)
+    {
+        if (LIKELY__((end - __atomic_load_n(&impl_->slowest_processor.offset, __ATOMIC_RELAXED))
+                <= (uint_fast64_t)buf_size_))
+            return true;
+
+        uint_fast64_t slowest = __atomic_load_n(&impl_->committed.offset, __ATOMIC_SEQ_CST);
+        for (unsigned int n = 0; n < processor_capacity; ++n) {
+            const uint_fast64_t offset = __atomic_load_n(&impl_->processor_cursors[n].offset,
+                    __ATOMIC_SEQ_CST);
+            if (offset < slowest)
+                slowest = offset;
+        }
+        __atomic_store_n(&impl_->slowest_processor.offset, slowest, __ATOMIC_RELAXED);
+
+        return (end - slowest) <= (uint_fast64_t)buf_size_;
+    }
+
+    struct _impl_t {
+        count_t reduced_size;
+        cursor_t slowest_processor;
+        cursor_t committed;
+        cursor_t write;
+        cursor_t processor_cursors[processor_capacity];
+        uint8_t buffer[0] __attribute__((aligned(cache_line_size)));
+    };
+    struct _impl_t *impl_;
+    int buf_size_;
+    size_t map_size_;
+    wait_strategy wait_;
+};
+
+#endif
@@ -1,7 +1,25 @@
+#ifndef OPGRID_RINGBUF_H
+#define OPGRID_RINGBUF_H
+
+#include <assert.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <new>
+#include <type_traits>
+
+#include "affinity.h"
 
 #ifdef LIKELY__
 #undef LIKELY__
@@ -25,10 +43,155 @@ struct cache_line_aligned_struct {
     uint8_t __padding[cache_line_padded_size(sizeof(T), cache_line_size)];
 } __attribute__((aligned(cache_line_size)));
 
+template<class T>
+struct dense_struct {
+    T content;
+};
+
+#ifdef CPU_RELAX__
+#undef CPU_RELAX__
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX__() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX__() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX__() __asm__ __volatile__("" ::: "memory")
+#endif
+
 #define VACANT__ (UINT_FAST64_MAX)
 
-template<class T, int processor_capacity, int cache_line_size = 64, int page_size = 4096>
-struct ring_buffer_t {
+// Wait strategies decide what a blocked publisher or processor does until
+// ready() holds; signal() follows every change that may satisfy a waiter.
+// process_shared says whether waiters in other processes still wake up,
+// which shared memory rings require.
+
+// Sleeps between checks. nanosleep rounds up to the timer slack, so even
+// one nanosecond means tens of microseconds of latency; the CPU stays idle.
+template<long nsec = 1>
+struct timed_wait_t {
+    enum { process_shared = 1 };
+
+    template<class F> void wait_until(F ready)
+    {
+        const timespec timeout = {0, nsec};
+
+        while (!ready())
+            nanosleep(&timeout, NULL);
+    }
+    void signal() {}
+};
+
+// Lowest latency, one core per waiter.
+struct spin_wait_t {
+    enum { process_shared = 1 };
+
+    template<class F> void wait_until(F ready)
+    {
+        while (!ready())
+            CPU_RELAX__();
+    }
+    void signal() {}
+};
+
+// Spins for a while, then gives the core away between checks.
+template<int spins = 100>
+struct yield_wait_t {
+    enum { process_shared = 1 };
+
+    template<class F> void wait_until(F ready)
+    {
+        for (int n = 0; !ready(); ++n) {
+            if (n < spins)
+                CPU_RELAX__();
+            else
+                sched_yield();
+        }
+    }
+    void signal() {}
+};
+
+// Spins briefly, then sleeps on a futex until signal() bumps the epoch.
+// Only the first signal() after a waiter parked wakes it; the rest, and
+// all of them while nobody sleeps, cost a fence and a load. The futex
+// lives in the ring_buffer_t object, so it only wakes threads of one
+// process.
+template<int spins = 100, int cache_line_size = 64>
+struct futex_wait_t {
+    enum { process_shared = 0 };
+
+    futex_wait_t() : epoch_(0), parked_(0) {}
+
+    template<class F> void wait_until(F ready)
+    {
+        for (int n = 0; n < spins; ++n) {
+            if (ready())
+                return;
+            CPU_RELAX__();
+        }
+        while (!ready()) {
+            const uint32_t epoch = __atomic_load_n(&epoch_, __ATOMIC_ACQUIRE);
+
+            // re-armed before every sleep, since a wake clears it for all
+            __atomic_exchange_n(&parked_, 1, __ATOMIC_SEQ_CST);
+            if (!ready())
+                syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+        }
+    }
+
+    void signal()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (UNLIKELY__(__atomic_load_n(&parked_, __ATOMIC_RELAXED) != 0)
+                && __atomic_exchange_n(&parked_, 0, __ATOMIC_SEQ_CST) != 0) {
+            __atomic_fetch_add(&epoch_, 1, __ATOMIC_RELEASE);
+            syscall(SYS_futex, &epoch_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+    }
+
+private:
+    uint32_t epoch_ __attribute__((aligned(cache_line_size)));
+    uint32_t parked_;
+};
+
+// Heap allocation that keeps the alignment of cache line aligned members
+// such as futex_wait_t's; operator new only guarantees that from C++17.
+template<int alignment>
+struct aligned_new {
+    static void* operator new(size_t size)
+    {
+        void* p = aligned_alloc(alignment, (size + alignment - 1) & ~(size_t)(alignment - 1));
+
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+    static void operator delete(void* p)
+    {
+        free(p);
+    }
+};
+
+// With a single producer the publisher claims and commits with plain
+// stores instead of atomic read-modify-writes and in-order commit spins.
+enum producer_mode_t {
+    multi_producer,
+    single_producer,
+};
+
+// Padded entries take a cache line each, so a publisher and a processor
+// working on neighbouring entries never share one. Dense entries are a
+// packed array of T: less memory traffic and prefetch-friendly for small
+// entries consumed in batches. The cursors stay padded either way.
+enum entry_layout_t {
+    padded_entries,
+    dense_entries,
+};
+
+template<class T, int processor_capacity, int cache_line_size = 64, int page_size = 4096,
+        producer_mode_t producer_mode = multi_producer, class wait_strategy = timed_wait_t<>,
+        entry_layout_t entry_layout = padded_entries>
+struct ring_buffer_t : aligned_new<cache_line_size> {
     struct count_t {
         uint_fast64_t count;
         uint8_t __padding[cache_line_padded_size(sizeof(uint_fast64_t), cache_line_size)];
@@ -39,54 +202,245 @@ struct ring_buffer_t {
         uint8_t __padding[cache_line_padded_size(sizeof(uint_fast64_t), cache_line_size)];
     } __attribute__((aligned(cache_line_size)));
 
-    typedef cache_line_aligned_struct<T, cache_line_size> entry_t;
-    typedef cache_line_aligned_struct<timespec, cache_line_size> yield_t;
+    typedef typename std::conditional<entry_layout == padded_entries,
+            cache_line_aligned_struct<T, cache_line_size>, dense_struct<T> >::type entry_t;
 
-    ring_buffer_t(int buf_size = 128) :
-            impl_(NULL), buf_size_(0)
+    // With numa_node the ring gets pages of its own on that node, which
+    // should be the node its processors run on. Throws std::bad_alloc
+    // when the memory cannot be had.
+    ring_buffer_t(int buf_size = 128, int numa_node = -1) :
+            impl_(NULL), buf_size_(0), shm_fd_(-1), map_size_(0), shm_name_(NULL)
     {
-        timeout__ = {{0,1},{0}};
-        int total_size = sizeof(_impl_t) + buf_size * sizeof(entry_t);
-        impl_ = (_impl_t*)aligned_alloc(page_size, total_size);
-        //posix_memalign((void**)&impl_, PAGE_SIZE, total_size);
+        const size_t total_size = sizeof(_impl_t) + (size_t)buf_size * sizeof(entry_t);
+        // a whole number of pages, as aligned_alloc wants a multiple of them
+        const size_t alloc_size = (total_size + page_size - 1) & ~(size_t)(page_size - 1);
+        if (numa_node >= 0) {
+            void* p = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+            impl_ = (_impl_t*)p;
+            map_size_ = alloc_size;
+            bind_to_node(impl_, map_size_, numa_node);
+        } else {
+            impl_ = (_impl_t*)aligned_alloc(page_size, alloc_size);
+            if (!impl_)
+                throw std::bad_alloc();
+        }
         buf_size_ = buf_size;
-        memset(impl_, 0, total_size);
-        for (unsigned int n = 0; n < processor_capacity; ++n)
-        impl_->entry_processor_cursors[n].sequence = VACANT__;
-        __atomic_store_n(&impl_->reduced_size.count, buf_size - 1, __ATOMIC_SEQ_CST);
+        _init(impl_, total_size, buf_size);
+    }
+
+    ~ring_buffer_t()
+    {
+        if (shm_fd_ < 0) {
+            if (map_size_)
+                munmap(impl_, map_size_);
+            else
+                free(impl_);
+            return;
+        }
+        munmap(impl_, map_size_);
+        close(shm_fd_);
+        if (shm_name_) {
+            shm_unlink(shm_name_);
+            free(shm_name_);
+        }
+    }
+
+    // Shared rings live in a shared memory segment, so publishers and
+    // processors can be separate processes. Entries are copied as plain
+    // bytes and the wait strategy must be process_shared.
+    // shm_create() makes a named POSIX segment, unlinked again when the
+    // creating ring is deleted, or an anonymous memfd when name is NULL;
+    // hand shm_fd() to the other processes (fork, SCM_RIGHTS) and attach
+    // with shm_attach_fd(). hugepages asks for 2MB pages, falling back to
+    // transparent huge pages; numa_node is as for the constructor. All
+    // three return NULL with errno set.
+    static ring_buffer_t* shm_create(const char* name, int buf_size, bool hugepages = false,
+            int numa_node = -1)
+    {
+        _check_shareable();
+        size_t size = sizeof(_impl_t) + buf_size * sizeof(entry_t);
+        int fd = -1;
+
+        if (buf_size <= 0 || (buf_size & (buf_size - 1))) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (name) {
+            fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        } else {
+#ifdef MFD_HUGETLB
+            if (hugepages) {
+                const size_t huge = 2 << 20;
+                const size_t huge_size = (size + huge - 1) & ~(huge - 1);
+
+                fd = memfd_create("ring_buffer_t", MFD_CLOEXEC | MFD_HUGETLB);
+                if (fd >= 0) {
+                    _impl_t* impl = _map_new(fd, huge_size);
+                    if (impl) {
+                        if (numa_node >= 0)
+                            bind_to_node(impl, huge_size, numa_node);
+                        return _create(impl, fd, huge_size, buf_size, NULL);
+                    }
+                    close(fd);
+                }
+            }
+#endif
+            fd = memfd_create("ring_buffer_t", MFD_CLOEXEC);
+        }
+        if (fd < 0)
+            return NULL;
+
+        _impl_t* impl = _map_new(fd, size);
+        if (!impl) {
+            const int err = errno;
+            if (name)
+                shm_unlink(name);
+            close(fd);
+            errno = err;
+            return NULL;
+        }
+        if (hugepages)
+            madvise(impl, size, MADV_HUGEPAGE);
+        if (numa_node >= 0)
+            bind_to_node(impl, size, numa_node);
+        return _create(impl, fd, size, buf_size, name);
+    }
+
+    static ring_buffer_t* shm_attach(const char* name)
+    {
+        _check_shareable();
+        const int fd = shm_open(name, O_RDWR, 0);
+
+        return (fd < 0) ? NULL : _attach(fd);
+    }
+
+    // fd stays the caller's.
+    static ring_buffer_t* shm_attach_fd(int fd)
+    {
+        _check_shareable();
+        const int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+        return (own < 0) ? NULL : _attach(own);
     }
 
+    int shm_fd() const
+    {
+        return shm_fd_;
+    }
+
+    // Takes a free processor slot, or fails at once when all of them are
+    // in use. The processor gets every entry published after this returns
+    // and nothing before; first is the sequence of the first one.
+    bool processor_barrier_try_register(count_t& entry_processor_number, uint_fast64_t& first)
+    {
+        if (!_claim_slot(entry_processor_number))
+            return false;
+        // a publisher that scanned the cursors before the slot was taken
+        // gated on no more than what is published now
+        first = 1 + __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&impl_->entry_processor_cursors[entry_processor_number.count].sequence,
+                first - 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Waits for a free slot instead.
     uint_fast64_t processor_barrier_register(count_t& entry_processor_number)
     {
-        uint_fast64_t vacant = VACANT__;
+        uint_fast64_t first;
+
+        if (!processor_barrier_try_register(entry_processor_number, first))
+            wait_.wait_until([&]() {
+                return processor_barrier_try_register(entry_processor_number, first);
+            });
+        return first;
+    }
+
+    // Work-queue mode: workers share one work sequence and each entry goes
+    // to exactly one of them, while publishers still gate on the slowest.
+    // Workers and broadcast processors can share a ring. Like a processor,
+    // a worker protects only what is published after it joins, so when the
+    // work sequence lags behind that it is moved up: unclaimed entries no
+    // worker held may already be overwritten and are skipped.
+    uint_fast64_t worker_barrier_register(count_t& worker_number)
+    {
+        if (!_claim_slot(worker_number))
+            wait_.wait_until([&]() { return _claim_slot(worker_number); });
+
+        // as in processor_barrier_try_register()
+        const uint_fast64_t published = __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&impl_->entry_processor_cursors[worker_number.count].sequence, published,
+                __ATOMIC_SEQ_CST);
+
+        uint_fast64_t work = __atomic_load_n(&impl_->work_sequence.sequence, __ATOMIC_RELAXED);
+
+        while (work < published
+                && !__atomic_compare_exchange_n(&impl_->work_sequence.sequence, &work, published,
+                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+        return ((work > published) ? work : published) + 1;
+    }
+
+    // Claims the next unclaimed entry and waits until it is published.
+    // Claiming also releases the entry the worker claimed before.
+    void worker_claim_entry_blocking(count_t& worker_number, cursor_t& cursor)
+    {
+        uint_fast64_t work = __atomic_load_n(&impl_->work_sequence.sequence, __ATOMIC_RELAXED);
 
         do {
-            for (unsigned int n = 0; n < processor_capacity; ++n) {
-                if (__atomic_compare_exchange_n(&impl_->entry_processor_cursors[n].sequence,
-                                &vacant,
-                                __atomic_load_n(&impl_->slowest_entry_processor.sequence, __ATOMIC_CONSUME),
-                                1,
-                                __ATOMIC_RELEASE,
-                                __ATOMIC_RELAXED))
-                {
-                    entry_processor_number.count = n;
-                    goto out;
-                }
-                vacant = VACANT__;
+            __atomic_store_n(&impl_->entry_processor_cursors[worker_number.count].sequence, work,
+                    __ATOMIC_SEQ_CST);
+        } while (!__atomic_compare_exchange_n(&impl_->work_sequence.sequence, &work, work + 1,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        wait_.signal();
+
+        const uint_fast64_t incur = work + 1;
+
+        cursor.sequence = incur;
+        if (incur > __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_ACQUIRE))
+            wait_.wait_until([&]() {
+                return incur <= __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_ACQUIRE);
+            });
+    }
+
+    // Vacates the slots of shared ring processors whose process is gone, so
+    // a crashed consumer stops holding the publishers back. Publishers
+    // blocked on a full shared ring call this every 1024 checks. A dead
+    // processor counts once it has been waited for; a pid the kernel has
+    // already reused keeps its slot until that process exits.
+    unsigned int processor_reap_dead()
+    {
+        const pid_t self = getpid();
+        unsigned int reaped = 0;
+
+        for (unsigned int n = 0; n < processor_capacity; ++n) {
+            int32_t owner = __atomic_load_n(&impl_->entry_processor_owners[n], __ATOMIC_ACQUIRE);
+
+            if (owner == 0 || owner == self || kill(owner, 0) == 0 || errno != ESRCH)
+                continue;
+            // the owner is dead, so nothing else can free the slot under us
+            if (__atomic_compare_exchange_n(&impl_->entry_processor_owners[n], &owner, 0,
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&impl_->entry_processor_cursors[n].sequence, VACANT__, __ATOMIC_RELEASE);
+                __atomic_fetch_and(&impl_->registry[n / 64], ~(1ULL << (n % 64)), __ATOMIC_RELEASE);
+                ++reaped;
             }
-        }while (1);
-        out:
-        if (!impl_->entry_processor_cursors[entry_processor_number.count].sequence)
-        {
-            __atomic_store_n(&impl_->entry_processor_cursors[entry_processor_number.count].sequence, 1, __ATOMIC_RELEASE);
-            return 1;
         }
-        return impl_->entry_processor_cursors[entry_processor_number.count].sequence;
+        if (reaped)
+            wait_.signal();
+        return reaped;
     }
 
     void processor_barrier_unregister(count_t& entry_processor_number)
     {
-        __atomic_store_n(&impl_->entry_processor_cursors[entry_processor_number.count].sequence, VACANT__, __ATOMIC_RELEASE);
+        const unsigned int n = entry_processor_number.count;
+
+        __atomic_store_n(&impl_->entry_processor_owners[n], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&impl_->entry_processor_cursors[n].sequence, VACANT__, __ATOMIC_RELEASE);
+        __atomic_fetch_and(&impl_->registry[n / 64], ~(1ULL << (n % 64)), __ATOMIC_RELEASE);
+        wait_.signal();
     }
 
     const entry_t& show_entry(cursor_t& cursor)
@@ -103,12 +457,37 @@ struct ring_buffer_t {
     {
         const cursor_t incur = { cursor.sequence, {0}};
 
-        while (incur.sequence > __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED))
-            nanosleep(&timeout__.content, NULL);
+        wait_.wait_until([&]() {
+            return incur.sequence <= __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED);
+        });
 
         cursor.sequence = __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_ACQUIRE);
     }
 
+    // For a processor that runs after the ndeps processors in deps: the
+    // entries it gets have been published and released by all of them, so
+    // stages can hand work down a pipeline or diamond on this one ring.
+    // A dependency that unregisters no longer holds anything back.
+    void processor_barrier_wait_blocking(cursor_t& cursor, const count_t* deps, unsigned int ndeps)
+    {
+        const uint_fast64_t incur = cursor.sequence;
+
+        if (incur > _available(deps, ndeps))
+            wait_.wait_until([&]() { return incur <= _available(deps, ndeps); });
+
+        cursor.sequence = _available(deps, ndeps);
+    }
+
+    bool processor_barrier_wait_nonblocking(cursor_t& cursor, const count_t* deps, unsigned int ndeps)
+    {
+        const uint_fast64_t available = _available(deps, ndeps);
+
+        if (cursor.sequence > available)
+            return false;
+        cursor.sequence = available;
+        return true;
+    }
+
     bool processor_barrier_wait_nonblocking(cursor_t& cursor)
     {
         const cursor_t incur = { cursor.sequence, {0} };
@@ -125,97 +504,307 @@ struct ring_buffer_t {
             cursor_t& cursor)
     {
         __atomic_store_n(&impl_->entry_processor_cursors[entry_processor_number.count].sequence,
-                cursor.sequence, __ATOMIC_RELAXED);
+                cursor.sequence, __ATOMIC_RELEASE);
+        wait_.signal();
     }
 
     void publisher_next_entry_blocking(cursor_t& cursor)
     {
-        cursor_t seq;
-        cursor_t slowest_reader;
-        const cursor_t incur = {1 + __atomic_fetch_add(&impl_->write_cursor.sequence, 1, __ATOMIC_RELAXED),
-            {0}};
-
-        cursor.sequence = incur.sequence;
-        do {
-            slowest_reader.sequence = VACANT__;
-            for (unsigned int n = 0; n < processor_capacity; ++n) {
-                seq.sequence = __atomic_load_n(&impl_->entry_processor_cursors[n].sequence, __ATOMIC_RELAXED);
-                if (seq.sequence < slowest_reader.sequence)
-                    slowest_reader.sequence = seq.sequence;
-            }
+        publisher_next_n_entries_blocking(cursor, 1);
+    }
 
-            if (UNLIKELY__(VACANT__ == slowest_reader.sequence))
-                slowest_reader.sequence = incur.sequence - (impl_->reduced_size.count & incur.sequence);
+    // Claims n consecutive entries with a single atomic add; cursor gets the
+    // first of them. The gate lets at most buf_size - 1 entries run ahead
+    // of the slowest processor, so n must not exceed that: a larger claim
+    // could never be granted and would wait forever.
+    void publisher_next_n_entries_blocking(cursor_t& cursor, unsigned int n)
+    {
+        uint_fast64_t incur;
 
-            __atomic_store_n(&impl_->slowest_entry_processor.sequence, slowest_reader.sequence, __ATOMIC_RELAXED);
+        assert(n >= 1 && n < (unsigned int)buf_size_);
 
-            if (LIKELY__((incur.sequence- slowest_reader.sequence) <= impl_->reduced_size.count))
-                return;
-            nanosleep(&timeout__.content, NULL);
-        } while (1);
+        if (producer_mode == single_producer) {
+            incur = n + impl_->write_cursor.sequence;
+            __atomic_store_n(&impl_->write_cursor.sequence, incur, __ATOMIC_RELAXED);
+        } else {
+            incur = n + __atomic_fetch_add(&impl_->write_cursor.sequence, n, __ATOMIC_RELAXED);
+        }
+        cursor.sequence = incur - n + 1;
+        if (UNLIKELY__(!_gate_open(incur)))
+            _wait_gate(incur);
     }
 
-    bool publisher_next_entry_nonblocking(cursor_t& cursor)
+    // Contiguous entries starting at cursor; n is clipped where the buffer
+    // wraps, so a run may take two spans to fill.
+    entry_t* entry_span(cursor_t& cursor, unsigned int& n)
     {
-        cursor_t seq;
-        cursor_t slowest_reader;
-        const cursor_t incur = {1 + __atomic_load_n(&impl_->write_cursor.sequence, __ATOMIC_RELAXED),
-            {0}};
+        const uint_fast64_t index = impl_->reduced_size.count & cursor.sequence;
 
-        cursor.sequence = incur.sequence;
-        slowest_reader.sequence = VACANT__;
-        for (unsigned int n = 0; n < processor_capacity; ++n)
-        {
-            seq.sequence = __atomic_load_n(&impl_->entry_processor_cursors[n].sequence, __ATOMIC_RELAXED);
-            if (seq.sequence < slowest_reader.sequence)
-                slowest_reader.sequence = seq.sequence;
-        }
+        if (n > buf_size_ - index)
+            n = buf_size_ - index;
+        return &impl_->buffer[index];
+    }
 
-        if (UNLIKELY__(VACANT__ == slowest_reader.sequence))
-            slowest_reader.sequence = incur.sequence - (impl_->reduced_size.count & incur.sequence);
-        __atomic_store_n(&impl_->slowest_entry_processor.sequence, slowest_reader.sequence, __ATOMIC_RELAXED);
+    // Fails only when the ring is full. A claim lost to another publisher
+    // is retried on the entry after the one it took.
+    bool publisher_next_entry_nonblocking(cursor_t& cursor)
+    {
+        uint_fast64_t incur = __atomic_load_n(&impl_->write_cursor.sequence, __ATOMIC_RELAXED);
 
-        if (LIKELY__((incur.sequence - slowest_reader.sequence) <= impl_->reduced_size.count))
-        {
-            seq.sequence = incur.sequence - 1;
-            if (__atomic_compare_exchange_n(&impl_->write_cursor.sequence, &seq.sequence, incur.sequence, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        do {
+            if (!_gate_open(incur + 1))
+                return false;
+            cursor.sequence = incur + 1;
+            if (producer_mode == single_producer) {
+                __atomic_store_n(&impl_->write_cursor.sequence, cursor.sequence, __ATOMIC_RELAXED);
                 return true;
-        }
-        return false;
+            }
+        } while (!__atomic_compare_exchange_n(&impl_->write_cursor.sequence, &incur, cursor.sequence,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return true;
     }
 
     void publisher_commit_entry_blocking (cursor_t& cursor)
     {
-        const uint_fast64_t required_read_sequence = cursor.sequence - 1;
-
-        while (__atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED) != required_read_sequence)
-            nanosleep(&timeout__.content, NULL);
-
-        __atomic_fetch_add(&impl_->max_read_cursor.sequence, 1, __ATOMIC_RELEASE);
+        publisher_commit_range_blocking(cursor, cursor);
     }
 
     int publisher_commit_entry_nonblocking (cursor_t& cursor)
     {
-        const uint_fast64_t required_read_sequence = cursor->seq - 1;
+        if (producer_mode == single_producer) {
+            __atomic_store_n(&impl_->max_read_cursor.sequence, cursor.sequence, __ATOMIC_RELEASE);
+            wait_.signal();
+            return 1;
+        }
+
+        const uint_fast64_t required_read_sequence = cursor.sequence - 1;
 
         if (__atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED) != required_read_sequence)
             return 0;
 
         __atomic_fetch_add(&impl_->max_read_cursor.sequence, 1, __ATOMIC_RELEASE);
+        wait_.signal();
         return 1;
     }
 
+    // Makes lo..hi visible at once, after every entry claimed before lo.
+    void publisher_commit_range_blocking(cursor_t& lo, cursor_t& hi)
+    {
+        if (producer_mode == multi_producer) {
+            const uint_fast64_t required_read_sequence = lo.sequence - 1;
+
+            if (__atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED) != required_read_sequence)
+                wait_.wait_until([&]() {
+                    return __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_RELAXED)
+                            == required_read_sequence;
+                });
+        }
+
+        __atomic_store_n(&impl_->max_read_cursor.sequence, hi.sequence, __ATOMIC_RELEASE);
+        wait_.signal();
+    }
+
 private:
+    static constexpr unsigned int registry_words_ = (processor_capacity + 63) / 64;
+
+    struct _layout_t {
+        uint64_t magic;
+        uint32_t entry_size;
+        uint32_t capacity;
+        uint32_t mode;
+        uint32_t buf_size;
+    } __attribute__((aligned(cache_line_size)));
+
     struct _impl_t {
+        _layout_t layout;
         count_t reduced_size;
         cursor_t slowest_entry_processor;
         cursor_t max_read_cursor;
         cursor_t write_cursor;
+        cursor_t work_sequence;
         cursor_t entry_processor_cursors[processor_capacity];
-        entry_t buffer[0];
+        // pid of each processor of a shared ring, 0 while vacant
+        int32_t entry_processor_owners[processor_capacity] __attribute__((aligned(cache_line_size)));
+        // one bit per taken processor slot
+        uint64_t registry[registry_words_] __attribute__((aligned(cache_line_size)));
+        entry_t buffer[0] __attribute__((aligned(cache_line_size)));
     };
+    static constexpr uint64_t shm_magic_ = 0x6f7072696e670002ULL;
+
+    ring_buffer_t(_impl_t* impl, int buf_size, int fd, size_t map_size, char* name) :
+            impl_(impl), buf_size_(buf_size), shm_fd_(fd), map_size_(map_size), shm_name_(name)
+    {
+    }
+
+    static void _check_shareable()
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "shared rings copy entries as plain bytes");
+        static_assert(wait_strategy::process_shared,
+                "the wait strategy cannot wake other processes");
+    }
+
+    static void _init(_impl_t* impl, size_t total_size, int buf_size)
+    {
+        memset(impl, 0, total_size);
+        for (unsigned int n = 0; n < processor_capacity; ++n)
+        impl->entry_processor_cursors[n].sequence = VACANT__;
+        __atomic_store_n(&impl->reduced_size.count, buf_size - 1, __ATOMIC_SEQ_CST);
+    }
+
+    static _impl_t* _map_new(int fd, size_t size)
+    {
+        if (ftruncate(fd, size) < 0)
+            return NULL;
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return (p == MAP_FAILED) ? NULL : (_impl_t*)p;
+    }
+
+    static ring_buffer_t* _create(_impl_t* impl, int fd, size_t size, int buf_size,
+            const char* name)
+    {
+        _init(impl, size, buf_size);
+        impl->layout.entry_size = sizeof(entry_t);
+        impl->layout.capacity = processor_capacity;
+        impl->layout.mode = producer_mode;
+        impl->layout.buf_size = buf_size;
+        // attachers only trust the segment once the magic is in place
+        __atomic_store_n(&impl->layout.magic, shm_magic_, __ATOMIC_RELEASE);
+        return new ring_buffer_t(impl, buf_size, fd, size, name ? strdup(name) : NULL);
+    }
+
+    static ring_buffer_t* _attach(int fd)
+    {
+        struct stat st;
+        void* p;
+
+        if (fstat(fd, &st) < 0)
+            goto fail;
+        if ((size_t)st.st_size < sizeof(_impl_t)) {
+            errno = EINVAL;
+            goto fail;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            goto fail;
+        {
+            _impl_t* impl = (_impl_t*)p;
+            const uint64_t magic = __atomic_load_n(&impl->layout.magic, __ATOMIC_ACQUIRE);
+            const uint32_t buf_size = impl->layout.buf_size;
+
+            if (magic == shm_magic_
+                    && impl->layout.entry_size == sizeof(entry_t)
+                    && impl->layout.capacity == processor_capacity
+                    && impl->layout.mode == producer_mode
+                    && sizeof(_impl_t) + (size_t)buf_size * sizeof(entry_t) <= (size_t)st.st_size)
+                return new ring_buffer_t(impl, buf_size, fd, st.st_size, NULL);
+            // a zero magic means the creator has not finished yet
+            errno = magic ? EINVAL : EAGAIN;
+            munmap(p, st.st_size);
+        }
+    fail:
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    void _wait_gate(uint_fast64_t incur)
+    {
+        unsigned int checks = 0;
+
+        if (shm_fd_ < 0) {
+            wait_.wait_until([&]() { return _gate_open(incur); });
+            return;
+        }
+        wait_.wait_until([&]() {
+            return _gate_open(incur)
+                    || ((++checks & 1023) == 0 && processor_reap_dead() && _gate_open(incur));
+        });
+    }
+
+    uint_fast64_t _available(const count_t* deps, unsigned int ndeps)
+    {
+        uint_fast64_t available = __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_ACQUIRE);
+
+        for (unsigned int n = 0; n < ndeps; ++n) {
+            const uint_fast64_t done = __atomic_load_n(&impl_->entry_processor_cursors[deps[n].count].sequence,
+                    __ATOMIC_ACQUIRE);
+            if (done < available)
+                available = done;
+        }
+        return available;
+    }
+
+    // Bits of the registry that stand for slots in word w.
+    static uint64_t _registry_mask(unsigned int w)
+    {
+        return (w < processor_capacity / 64) ? ~0ULL : (1ULL << (processor_capacity % 64)) - 1;
+    }
+
+    // Finds a clear bit in the registry and takes its slot. The cursor
+    // starts at the cached slowest sequence, which never lets the slot
+    // protect less than the other processors do.
+    bool _claim_slot(count_t& entry_processor_number)
+    {
+        for (unsigned int w = 0; w < registry_words_; ++w) {
+            const uint64_t all = _registry_mask(w);
+            uint64_t used = __atomic_load_n(&impl_->registry[w], __ATOMIC_RELAXED);
+
+            while ((used & all) != all) {
+                const unsigned int n = w * 64 + __builtin_ctzll(~used);
+
+                if (!__atomic_compare_exchange_n(&impl_->registry[w], &used, used | (1ULL << (n % 64)),
+                        1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                    continue;
+                __atomic_store_n(&impl_->entry_processor_cursors[n].sequence,
+                        __atomic_load_n(&impl_->slowest_entry_processor.sequence, __ATOMIC_RELAXED),
+                        __ATOMIC_SEQ_CST);
+                if (shm_fd_ >= 0)
+                    __atomic_store_n(&impl_->entry_processor_owners[n], getpid(), __ATOMIC_RELEASE);
+                entry_processor_number.count = n;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // True once sequence incur can be written without lapping a processor.
+    // slowest_entry_processor caches the minimum of the processor cursors;
+    // they are only rescanned when incur would pass it, and only the slots
+    // set in the registry. A stale value is never above the true minimum,
+    // so the check errs on the safe side. Without processors publishers
+    // still may not lap entries that are not yet published.
+    bool _gate_open(uint_fast64_t incur)
+    {
+        if (LIKELY__((incur - __atomic_load_n(&impl_->slowest_entry_processor.sequence, __ATOMIC_RELAXED))
+                <= impl_->reduced_size.count))
+            return true;
+
+        uint_fast64_t slowest_reader = __atomic_load_n(&impl_->max_read_cursor.sequence, __ATOMIC_SEQ_CST);
+        for (unsigned int w = 0; w < registry_words_; ++w) {
+            uint64_t used = __atomic_load_n(&impl_->registry[w], __ATOMIC_SEQ_CST);
+
+            while (used) {
+                const unsigned int n = w * 64 + __builtin_ctzll(used);
+                const uint_fast64_t seq = __atomic_load_n(&impl_->entry_processor_cursors[n].sequence,
+                        __ATOMIC_SEQ_CST);
+                if (seq < slowest_reader)
+                    slowest_reader = seq;
+                used &= used - 1;
+            }
+        }
+        __atomic_store_n(&impl_->slowest_entry_processor.sequence, slowest_reader, __ATOMIC_RELAXED);
+
+        return (incur - slowest_reader) <= impl_->reduced_size.count;
+    }
+
     struct _impl_t *impl_;
     int buf_size_;
-    yield_t timeout__;
+    int shm_fd_;
+    size_t map_size_;
+    char* shm_name_;
+    wait_strategy wait_;
 };
 
+#endif
@@ -0,0 +1,131 @@
+#ifndef OPGRID_BUFPOOL_H
+#define OPGRID_BUFPOOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+#include <sys/mman.h>
+
+#include "affinity.h"
+
+// Fixed-size buffers carved out of mmap'ed slabs. A buffer is rounded up to
+// a cache line, or to whole pages once it spans a page, and free buffers
+// are chained through their first word. Slabs are only given back when the
+// pool is destroyed. Not thread-safe; each reactor owns one.
+class bufpool_t {
+public:
+  enum {
+    cache_line_size = 64,
+    page_size       = 4096,
+    huge_page_size  = 2 << 20,
+    slab_size       = 256 << 10,
+  };
+  struct stat_t {
+    uint64_t gets;       // buffers handed out
+    uint64_t hits;       // ... of those, without growing the pool
+    size_t in_use;
+    size_t high_water;   // most buffers in use at once
+    size_t slabs;
+  };
+
+  bufpool_t(): _buf_size(0), _slab_bytes(0), _hugepages(false), _node(-1),
+    _free(NULL) {
+    _stat.gets = _stat.hits = 0;
+    _stat.in_use = _stat.high_water = _stat.slabs = 0;
+  }
+  ~bufpool_t() {
+    for (size_t i = 0; i < _slabs.size(); i++)
+      munmap(_slabs[i].first, _slabs[i].second);
+  }
+
+  // hugepages backs slabs with 2MB pages when the system has them reserved
+  // and asks for transparent huge pages otherwise. node >= 0 places the
+  // slabs on that NUMA node.
+  void init(size_t buf_size, bool hugepages, int node = -1) {
+    size_t align = (buf_size >= page_size) ? page_size : cache_line_size;
+    if (buf_size < sizeof(free_t))
+      buf_size = sizeof(free_t);
+    _buf_size = (buf_size + align - 1) & ~(align - 1);
+    _hugepages = hugepages;
+    _node = node;
+    size_t unit = hugepages ? huge_page_size : page_size;
+    _slab_bytes = hugepages ? huge_page_size : slab_size;
+    if (_slab_bytes < _buf_size)
+      _slab_bytes = (_buf_size + unit - 1) & ~(unit - 1);
+  }
+
+  size_t buf_size() const {
+    return _buf_size;
+  }
+
+  void* get() {
+    _stat.gets++;
+    if (_free != NULL)
+      _stat.hits++;
+    else if (!_grow())
+      return NULL;
+    free_t* b = _free;
+    _free = b->next;
+    if (++_stat.in_use > _stat.high_water)
+      _stat.high_water = _stat.in_use;
+    return b;
+  }
+
+  void put(void* buf) {
+    if (buf == NULL)
+      return;
+    free_t* b = (free_t*)buf;
+    b->next = _free;
+    _free = b;
+    _stat.in_use--;
+  }
+
+  const stat_t& stat() const {
+    return _stat;
+  }
+
+private:
+  struct free_t {
+    free_t* next;
+  };
+
+  bool _grow() {
+    if (_buf_size == 0)
+      return false;
+    void* mem = MAP_FAILED;
+    if (_hugepages)
+      mem = mmap(NULL, _slab_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED) {
+      mem = mmap(NULL, _slab_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED)
+        return false;
+      if (_hugepages)
+        madvise(mem, _slab_bytes, MADV_HUGEPAGE);
+    }
+    if (_node >= 0)
+      bind_to_node(mem, _slab_bytes, _node);
+    _slabs.push_back(std::make_pair(mem, _slab_bytes));
+    _stat.slabs++;
+    size_t n = _slab_bytes / _buf_size;
+    for (size_t i = n; i > 0; i--) {
+      free_t* b = (free_t*)((uint8_t*)mem + (i - 1) * _buf_size);
+      b->next = _free;
+      _free = b;
+    }
+    return true;
+  }
+
+  size_t _buf_size;
+  size_t _slab_bytes;
+  bool _hugepages;
+  int _node;
+  free_t* _free;
+  stat_t _stat;
+  std::vector<std::pair<void*, size_t> > _slabs;
+};
+
+#endif
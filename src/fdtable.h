@@ -0,0 +1,145 @@
+#ifndef OPGRID_FDTABLE_H
+#define OPGRID_FDTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/resource.h>
+
+// Dense table indexed by file descriptor. Slots live in fixed chunks that
+// are allocated once and never move, so pointers into the table stay valid.
+// Every release bumps the slot generation; an id built from (gen, fd)
+// detects a descriptor number the kernel has handed out again. A slot may
+// be released on one thread and acquired again on another once the fd is
+// reused, so the release publishes everything done with the value.
+template<class V, int chunk_bits = 10> class fdtable_t {
+public:
+  typedef uint64_t id_t;
+  enum { chunk_size = 1 << chunk_bits };
+
+  fdtable_t(size_t capacity = 0): _nchunks(0), _chunks(NULL) {
+    if (capacity == 0) {
+      struct rlimit rl;
+      capacity = 1024;
+      if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        capacity = rl.rlim_cur;
+    }
+    _nchunks = (capacity + chunk_size - 1) >> chunk_bits;
+    _chunks = new std::atomic<slot_t*>[_nchunks];
+    for (size_t i = 0; i < _nchunks; i++)
+      _chunks[i].store(NULL, std::memory_order_relaxed);
+  }
+
+  ~fdtable_t() {
+    for (size_t i = 0; i < _nchunks; i++)
+      delete[] _chunks[i].load(std::memory_order_relaxed);
+    delete[] _chunks;
+  }
+
+  static id_t make_id(int fd, uint32_t gen) {
+    return ((id_t)gen << 32) | (uint32_t)fd;
+  }
+  static int id_fd(id_t id) {
+    return (int)(uint32_t)id;
+  }
+
+  // Marks the slot of fd in use and returns its value reset to V().
+  V* acquire(int fd, id_t& id) {
+    slot_t* s = _slot(fd, true);
+    if (s == NULL || s->used.load(std::memory_order_acquire))
+      return NULL;
+    s->value = V();
+    s->used.store(true, std::memory_order_relaxed);
+    id = make_id(fd, s->gen.load(std::memory_order_relaxed));
+    return &s->value;
+  }
+
+  void release(int fd) {
+    slot_t* s = _slot(fd, false);
+    if (s == NULL || !s->used.load(std::memory_order_relaxed))
+      return;
+    s->gen.fetch_add(1, std::memory_order_relaxed);
+    s->used.store(false, std::memory_order_release);
+  }
+
+  V* find(int fd) const {
+    slot_t* s = _slot(fd, false);
+    return (s != NULL && s->used.load(std::memory_order_acquire))
+           ? &s->value : NULL;
+  }
+
+  V* find(id_t id) const {
+    slot_t* s = _slot(id_fd(id), false);
+    if (s == NULL || !s->used.load(std::memory_order_acquire)
+        || s->gen.load(std::memory_order_relaxed) != (uint32_t)(id >> 32))
+      return NULL;
+    return &s->value;
+  }
+
+  // A word kept beside the slot of fd rather than in its value: acquire()
+  // and release() leave it alone and any thread may read it. It is 0 until
+  // set, and setting 0 allocates nothing.
+  uint32_t word(int fd) const {
+    slot_t* s = _slot(fd, false);
+    return (s != NULL) ? s->word.load(std::memory_order_acquire) : 0;
+  }
+
+  void set_word(int fd, uint32_t w) {
+    slot_t* s = _slot(fd, w != 0);
+    if (s != NULL)
+      s->word.store(w, std::memory_order_release);
+  }
+
+  id_t current_id(int fd) const {
+    slot_t* s = _slot(fd, false);
+    return (s != NULL && s->used.load(std::memory_order_acquire))
+           ? make_id(fd, s->gen.load(std::memory_order_relaxed)) : 0;
+  }
+
+  template<class F> void for_each(F f) {
+    for (size_t c = 0; c < _nchunks; c++) {
+      slot_t* chunk = _chunks[c].load(std::memory_order_acquire);
+      if (chunk == NULL)
+        continue;
+      for (int i = 0; i < chunk_size; i++) {
+        if (chunk[i].used.load(std::memory_order_acquire))
+          f((int)((c << chunk_bits) + i), chunk[i].value);
+      }
+    }
+  }
+
+private:
+  struct slot_t {
+    std::atomic<uint32_t> gen;
+    std::atomic<bool> used;
+    std::atomic<uint32_t> word;
+    V value;
+    slot_t(): gen(1), used(false), word(0) {}
+  };
+
+  slot_t* _slot(int fd, bool create) const {
+    if (fd < 0)
+      return NULL;
+    size_t c = (size_t)fd >> chunk_bits;
+    if (c >= _nchunks)
+      return NULL;
+    slot_t* chunk = _chunks[c].load(std::memory_order_acquire);
+    if (chunk == NULL) {
+      if (!create)
+        return NULL;
+      slot_t* fresh = new slot_t[chunk_size];
+      if (_chunks[c].compare_exchange_strong(chunk, fresh,
+            std::memory_order_acq_rel))
+        chunk = fresh;
+      else
+        delete[] fresh;
+    }
+    return &chunk[fd & (chunk_size - 1)];
+  }
+
+  size_t _nchunks;
+  std::atomic<slot_t*>* _chunks;
+};
+
+#endif
@@ -4,77 +4,150 @@
 #include <iostream>
 
 #include "workbit.h"
+#include "opstage.h"
 
-class opnode : public workbit<opnode> {
+class opnode : public workbit<opnode>, public opstage_t<opnode> {
 public:
+  enum { DEFAULT_MAX_FRAME = 1 << 24 };
+
+  opnode(): _max_frame(DEFAULT_MAX_FRAME) {}
+
+  // A peer announcing a longer frame is disconnected before anything is
+  // allocated for it.
+  void set_max_frame(size_t len) {
+    _max_frame = len;
+  }
+
   void* connection_accepted(int fd, struct sockaddr* addr) {
     std::cout << " accepted: " << fd << "\n";
-    return NULL;
+    return new nodeconnection_t();
   }
 
   void* connection_made(int fd) {
     std::cout << " connected: " << fd << "\n";
-    return NULL;
+    return new nodeconnection_t();
   }
 
   void connection_closed(const connection_t& conn) {
     std::cout << " lost     : " << conn.fd << "\n";
+    nodeconnection_t* nc = (nodeconnection_t*)conn.extra;
+    if (nc->frame != NULL)
+      _release_frame(conn, *nc);
+    delete nc;
   }
 
-  void* allocate_buf(int fd, size_t& len) {
-    if (len == 0)
-      len = 65535;
-    return malloc(len);
-  }
-
-  void release_buf(int fd, void* buf) {
-    free(buf);
-  }
-
+  // A frame is a 4-byte big-endian length followed by that many bytes.
+  // Frames that sit whole in the receive buffer are passed on in place;
+  // only one spanning reads is copied, once, into an assembly buffer.
   int data(const connection_t& conn, size_t len, void* data) {
     nodeconnection_t& nc = *(nodeconnection_t*)conn.extra;
-    size_t bytes_read = _read_frame(data, len, nc);
-    while (nc.bytes_read == sizeof(nc.frame_length)+nc.frame_length) {
-      std::cout << "packet length:"<< nc.frame_length << "\n";
-      nc.reset();
-      data = (uint8_t*)data + bytes_read;
-      len -= bytes_read;
-      bytes_read = _read_frame(data, len, nc);
+    if (nc.rejected)
+      return -1;
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    while (p < end) {
+      if (nc.frame != NULL) {
+        size_t n = std::min((size_t)(end - p), nc.frame_length - nc.bytes_read);
+        memcpy(nc.frame + nc.bytes_read, p, n);
+        nc.bytes_read += n;
+        p += n;
+        if (nc.bytes_read < nc.frame_length)
+          break;
+        frame(conn, nc.frame, nc.frame_length);
+        _release_frame(conn, nc);
+        continue;
+      }
+      if (nc.header_read == 0 && end - p >= (ptrdiff_t)sizeof(uint32_t)) {
+        nc.frame_length = _decode_length(p);
+        p += sizeof(uint32_t);
+      } else {
+        size_t n = std::min((size_t)(end - p),
+                            sizeof(uint32_t) - nc.header_read);
+        memcpy(nc.header + nc.header_read, p, n);
+        nc.header_read += n;
+        p += n;
+        if (nc.header_read < sizeof(uint32_t))
+          break;
+        nc.frame_length = _decode_length(nc.header);
+      }
+      nc.header_read = 0;
+      if (nc.frame_length > _max_frame) {
+        // the stream cannot be resynchronized; the reactor sees the
+        // hangup and closes the connection
+        std::cout << "frame too long: " << nc.frame_length << "\n";
+        nc.rejected = true;
+        shutdown(conn.fd, SHUT_RDWR);
+        return -1;
+      }
+      if ((size_t)(end - p) >= nc.frame_length) {
+        frame(conn, p, nc.frame_length);
+        p += nc.frame_length;
+        continue;
+      }
+      if (_assemble_frame(conn, nc) < 0)
+        return -1;
     }
     return 0;
   }
 
+  // data stays valid only for the duration of the call. With the stage
+  // running the frame is handed to a processor thread instead.
+  void frame(const connection_t& conn, const uint8_t* data, size_t len) {
+    if (stage_running()) {
+      publish_frame(conn.id, conn.fd, data, len);
+      return;
+    }
+    std::cout << "packet length:"<< len << "\n";
+  }
+
+  void process_frame(const frame_t& f) {
+    std::cout << "packet length:"<< f.len << "\n";
+  }
+
 private:
   struct nodeconnection_t {
-    size_t bytes_read;
+    uint8_t header[sizeof(uint32_t)];
+    size_t header_read;
     size_t frame_length;
-    std::string packet;
-    void reset(){
-      bytes_read = 0; frame_length = 0;
-      packet.clear();
-    }
+    uint8_t* frame;       // assembly buffer of a frame spanning reads
+    size_t bytes_read;    // ... and how much of it is filled
+    bool pooled;
+    bool rejected;        // announced a frame over the maximum
+    nodeconnection_t(): header_read(0), frame_length(0), frame(NULL),
+      bytes_read(0), pooled(false), rejected(false) {}
   };
-  int _read_frame(void* buf, size_t len, nodeconnection_t& conn) {
-    size_t bytes_read = 0;
-    if (conn.bytes_read < sizeof(conn.frame_length)) {
-      size_t to_read = sizeof(conn.frame_length) - conn.bytes_read;
-      to_read = std::min(to_read, len);
-      memcpy((uint8_t*)&conn.frame_length + conn.bytes_read, buf, to_read);
-      conn.bytes_read += to_read;
-      buf = (uint8_t*)buf + to_read;
-      len -= to_read;
-      bytes_read += to_read;
-      if (conn.bytes_read < sizeof(conn.frame_length))
-        return to_read;
-      conn.frame_length = ntohl(conn.frame_length);
+
+  static size_t _decode_length(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+  }
+
+  // Frames that fit a receive buffer are assembled in one from the
+  // reactor's pool; larger ones get a buffer of exactly their length.
+  int _assemble_frame(const connection_t& conn, nodeconnection_t& nc) {
+    size_t len = 0;
+    void* buf = allocate_buf(conn.fd, len);
+    nc.pooled = (buf != NULL && len >= nc.frame_length);
+    if (!nc.pooled) {
+      release_buf(conn.fd, buf);
+      buf = malloc(nc.frame_length);
+      if (buf == NULL)
+        return -1;
     }
-    size_t to_read = sizeof(conn.frame_length) + conn.frame_length 
-                     - conn.bytes_read;
-    to_read = std::min(to_read, len);
-    conn.packet.append((char*)buf, to_read);
-    conn.bytes_read += to_read;
-    bytes_read += to_read;
-    return bytes_read;
+    nc.frame = (uint8_t*)buf;
+    nc.bytes_read = 0;
+    return 0;
   }
-};
 
+  void _release_frame(const connection_t& conn, nodeconnection_t& nc) {
+    if (nc.pooled)
+      release_buf(conn.fd, nc.frame);
+    else
+      free(nc.frame);
+    nc.frame = NULL;
+    nc.bytes_read = 0;
+  }
+
+  size_t _max_frame;
+};
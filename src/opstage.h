@@ -0,0 +1,170 @@
+#ifndef OPGRID_OPSTAGE_H
+#define OPGRID_OPSTAGE_H
+
+#include <new>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "bytering.h"
+
+// Moves frames off the reactor threads. Reactors copy frames into a
+// byte_ring_t and processor threads consume them in batches; frames of
+// one fd always land on the same processor, so they stay in order.
+// By default idle processors spin briefly and then yield between checks,
+// which keeps publishing free of syscalls; futex_wait_t<> lets them sleep
+// instead where the stage is mostly idle.
+// Reactor threads publish without synchronizing with start_stage() and
+// stop_stage(), so start the stage before the reactors and stop it after
+// them.
+// The derived class supplies
+//   void process_frame(const frame_t& frame);
+template<class T, int processor_capacity = 8,
+         class wait_strategy = yield_wait_t<> > class opstage_t {
+public:
+  struct frame_t {
+    uint64_t conn;
+    int fd;           // -1 tells the processors to exit
+    uint32_t len;
+    uint8_t* data;    // in the ring, or on the heap if it did not fit
+  };
+  typedef byte_ring_t<processor_capacity, 64, 4096,
+                      multi_producer, wait_strategy> ring_t;
+
+  opstage_t(): _ring(NULL), _nprocessors(0) {}
+  ~opstage_t() {
+    stop_stage();
+  }
+
+  // ring_size is in bytes and must be a power of two. Processor i runs on
+  // cpus[i % cpus.size()] when cpus is given, and the ring then lives on
+  // the NUMA node of the first of them.
+  bool start_stage(int nprocessors, int ring_size = 1 << 20,
+                   const std::vector<int>& cpus = std::vector<int>()) {
+    if (_ring != NULL)
+      return true;
+    if (nprocessors <= 0 || nprocessors > processor_capacity)
+      return false;
+    for (size_t i = 0; i < cpus.size(); i++) {
+      if (!cpu_allowed(cpus[i]))
+        return false;
+    }
+    _cpus.clear();
+    for (int i = 0; i < nprocessors && !cpus.empty(); i++)
+      _cpus.push_back(cpus[i % cpus.size()]);
+    try {
+      _ring = new ring_t(ring_size, _cpus.empty() ? -1 : cpu_node(_cpus[0]));
+    } catch (const std::bad_alloc&) {
+      return false;
+    }
+    _nprocessors = nprocessors;
+    // register on this thread so nothing published from now on is missed
+    for (int i = 0; i < nprocessors; i++) {
+      typename ring_t::count_t id;
+      uint_fast64_t first = _ring->processor_register(id);
+      _processors.push_back(std::thread(_run, this, i, id.count, first));
+    }
+    return true;
+  }
+
+  void stop_stage() {
+    if (_ring == NULL)
+      return;
+    _publish(0, -1, NULL, NULL, 0);
+    for (size_t i = 0; i < _processors.size(); i++)
+      _processors[i].join();
+    _processors.clear();
+    delete _ring;
+    _ring = NULL;
+    _nprocessors = 0;
+  }
+
+  bool stage_running() const {
+    return _ring != NULL;
+  }
+
+  // Where processor i was placed; cpu and node are -1 when it is not pinned.
+  bool processor_placement(int i, int& cpu, int& node) const {
+    if (i < 0 || i >= _nprocessors)
+      return false;
+    cpu = _cpus.empty() ? -1 : _cpus[i];
+    node = _cpus.empty() ? -1 : cpu_node(cpu);
+    return true;
+  }
+
+  // Copies the frame out of the receive buffer, which the reactor reuses
+  // as soon as data() returns. Blocks while the ring is full.
+  bool publish_frame(uint64_t conn, int fd, const void* data, size_t len) {
+    if (len > _ring->max_record() - sizeof(frame_t)) {
+      uint8_t* copy = (uint8_t*)malloc(len);
+      if (copy == NULL)
+        return false;
+      memcpy(copy, data, len);
+      _publish(conn, fd, copy, NULL, len);
+      return true;
+    }
+    _publish(conn, fd, NULL, data, len);
+    return true;
+  }
+
+private:
+  // A record holds the frame_t, followed by the frame itself unless it
+  // had to go on the heap.
+  void _publish(uint64_t conn, int fd, uint8_t* heap, const void* data,
+                size_t len) {
+    typename ring_t::claim_t claim;
+    uint8_t* record = _ring->publisher_claim_blocking(
+        claim, sizeof(frame_t) + (heap ? 0 : len));
+    frame_t* f = (frame_t*)record;
+    f->conn = conn;
+    f->fd = fd;
+    f->len = len;
+    f->data = heap;
+    if (!heap)
+      memcpy(record + sizeof(frame_t), data, len);
+    _ring->publisher_commit_blocking(claim);
+  }
+
+  // slot is the count_t's number; the cache line aligned struct is not
+  // passed by value
+  static void _run(opstage_t* stage, int processor, uint_fast64_t slot,
+                   uint_fast64_t first) {
+    if (!stage->_cpus.empty())
+      pin_thread(stage->_cpus[processor]);
+    stage->_process(processor, slot, first);
+  }
+
+  // Every processor walks the whole ring and only handles its own shard.
+  void _process(int processor, uint_fast64_t slot, uint_fast64_t offset) {
+    typename ring_t::count_t id;
+    id.count = slot;
+    for (;;) {
+      uint_fast64_t end = _ring->processor_wait_blocking(offset);
+      while (offset != end) {
+        const uint8_t* record = _ring->processor_next_record(offset)->data;
+        frame_t f = *(const frame_t*)record;
+        if (f.fd < 0) {
+          _ring->processor_unregister(id);
+          return;
+        }
+        if (f.fd % _nprocessors != processor)
+          continue;
+        uint8_t* heap = f.data;
+        if (heap == NULL)
+          f.data = (uint8_t*)record + sizeof(frame_t);
+        static_cast<T*>(this)->process_frame(f);
+        free(heap);
+      }
+      _ring->processor_release(id, offset);
+    }
+  }
+
+  ring_t* _ring;
+  int _nprocessors;
+  std::vector<int> _cpus;     // per processor, empty when not pinned
+  std::vector<std::thread> _processors;
+};
+
+#endif
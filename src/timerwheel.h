@@ -0,0 +1,166 @@
+#ifndef OPGRID_TIMERWHEEL_H
+#define OPGRID_TIMERWHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Hierarchical timing wheel over integer ticks. Timers are intrusive nodes
+// owned by the caller, so scheduling and cancelling are O(1) and allocate
+// nothing. Level 0 holds what expires within one revolution; a timer
+// further out sits on a coarser level until its slot comes up and is then
+// cascaded down. Not thread-safe; each reactor owns one.
+template<int levels = 4, int slot_bits = 8> class timer_wheel_t {
+public:
+  enum {
+    slots = 1 << slot_bits,
+    slot_mask = slots - 1,
+  };
+  struct node_t {
+    node_t* next;
+    node_t* prev;
+    uint64_t expires;
+    uint64_t tag;       // for the owner, e.g. which connection fired
+    node_t(): next(NULL), prev(NULL), expires(0), tag(0) {}
+    bool pending() const {
+      return next != NULL;
+    }
+  };
+
+  // now is the current tick; nothing scheduled expires before it.
+  explicit timer_wheel_t(uint64_t now = 0): _now(now), _count(0) {
+    for (int l = 0; l < levels; l++) {
+      for (int s = 0; s < slots; s++)
+        _empty(_wheel[l][s]);
+    }
+  }
+
+  // Replaces any earlier schedule of n. An expiry in the past fires on the
+  // next advance(); one beyond the span of the wheel is pulled in to it.
+  void schedule(node_t& n, uint64_t expires) {
+    if (n.pending())
+      cancel(n);
+    if (expires < _now)
+      expires = _now;
+    const uint64_t span = (uint64_t)1 << (levels * slot_bits);
+    if (expires - _now >= span)
+      expires = _now + span - 1;
+    n.expires = expires;
+    _link(_slot_for(expires), n);
+    _count++;
+  }
+
+  void cancel(node_t& n) {
+    if (!n.pending())
+      return;
+    n.prev->next = n.next;
+    n.next->prev = n.prev;
+    n.next = n.prev = NULL;
+    _count--;
+  }
+
+  size_t size() const {
+    return _count;
+  }
+
+  // Fires every timer expiring at or before now, in expiry order between
+  // ticks. fire(node_t&) may schedule or cancel any timer, the one firing
+  // included.
+  template<class F> void advance(uint64_t now, F fire) {
+    if (_count == 0) {
+      if (now >= _now)
+        _now = now + 1;
+      return;
+    }
+    while (_now <= now) {
+      const int idx = _now & slot_mask;
+      if (idx == 0)
+        _cascade(1);
+      node_t due;
+      _empty(due);
+      _splice(_wheel[0][idx], due);
+      _now++;
+      while (due.next != &due) {
+        node_t& n = *due.next;
+        cancel(n);
+        fire(n);
+      }
+      if (_count == 0) {
+        if (now >= _now)
+          _now = now + 1;
+        return;
+      }
+    }
+  }
+
+  // The tick to wake up at: the next expiry within this revolution of
+  // level 0, or else the end of it where the next cascade happens.
+  // UINT64_MAX when nothing is scheduled.
+  uint64_t next_tick() const {
+    if (_count == 0)
+      return UINT64_MAX;
+    if ((_now & slot_mask) == 0)
+      return _now;
+    for (uint64_t t = _now; ; t++) {
+      if (_wheel[0][t & slot_mask].next != &_wheel[0][t & slot_mask])
+        return t;
+      if (((t + 1) & slot_mask) == 0)
+        return t + 1;
+    }
+  }
+
+private:
+  static void _empty(node_t& head) {
+    head.next = head.prev = &head;
+  }
+
+  static void _link(node_t& head, node_t& n) {
+    n.prev = head.prev;
+    n.next = &head;
+    head.prev->next = &n;
+    head.prev = &n;
+  }
+
+  // moves every node of from to the end of to; the counts stay as they are
+  static void _splice(node_t& from, node_t& to) {
+    if (from.next == &from)
+      return;
+    from.next->prev = to.prev;
+    to.prev->next = from.next;
+    from.prev->next = &to;
+    to.prev = from.prev;
+    _empty(from);
+  }
+
+  node_t& _slot_for(uint64_t expires) {
+    const uint64_t delta = expires - _now;
+    int l = 0;
+    while (l + 1 < levels && delta >= ((uint64_t)1 << ((l + 1) * slot_bits)))
+      l++;
+    return _wheel[l][(expires >> (l * slot_bits)) & slot_mask];
+  }
+
+  // Redistributes the level's current slot over the finer levels, and the
+  // next level's too when this one has come round.
+  void _cascade(int l) {
+    if (l >= levels)
+      return;
+    const int idx = (_now >> (l * slot_bits)) & slot_mask;
+    if (idx == 0)
+      _cascade(l + 1);
+    node_t moving;
+    _empty(moving);
+    _splice(_wheel[l][idx], moving);
+    while (moving.next != &moving) {
+      node_t& n = *moving.next;
+      n.prev->next = n.next;
+      n.next->prev = n.prev;
+      _link(_slot_for(n.expires), n);
+    }
+  }
+
+  uint64_t _now;      // the next tick advance() processes
+  size_t _count;
+  node_t _wheel[levels][slots];
+};
+
+#endif
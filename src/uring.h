@@ -0,0 +1,230 @@
+#ifndef OPGRID_URING_H
+#define OPGRID_URING_H
+
+#include <cstdint>
+#include <cstring>
+#include <csignal>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// Minimal io_uring binding on the raw syscalls: one submission and one
+// completion ring plus provided buffer rings. Not thread-safe; a ring is
+// owned by the thread that submits to it.
+class uring_t {
+public:
+  uring_t(): _fd(-1), _sq_ptr(NULL), _cq_ptr(NULL), _sqes(NULL),
+    _sq_sz(0), _cq_sz(0), _sq_entries(0), _sqe_tail(0), _sqe_submitted(0) {}
+  ~uring_t() {
+    exit();
+  }
+
+  int init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+    _fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (_fd < 0)
+      return -1;
+    _sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      _sq_sz = _cq_sz = (_sq_sz > _cq_sz) ? _sq_sz : _cq_sz;
+    _sq_ptr = mmap(NULL, _sq_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED)
+      return _fail();
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      _cq_ptr = _sq_ptr;
+    } else {
+      _cq_ptr = mmap(NULL, _cq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+      if (_cq_ptr == MAP_FAILED)
+        return _fail();
+    }
+    _sqes = (struct io_uring_sqe*)mmap(NULL,
+        p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED)
+      return _fail();
+
+    uint8_t* sq = (uint8_t*)_sq_ptr;
+    uint8_t* cq = (uint8_t*)_cq_ptr;
+    _sq_head = (unsigned*)(sq + p.sq_off.head);
+    _sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    _sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < _sq_entries; i++)
+      array[i] = i;
+    _cq_head = (unsigned*)(cq + p.cq_off.head);
+    _cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    _cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    _sqe_tail = _sqe_submitted = *_sq_tail;
+    return 0;
+  }
+
+  void exit() {
+    if (_sqes != NULL && _sqes != MAP_FAILED)
+      munmap(_sqes, _sq_entries * sizeof(struct io_uring_sqe));
+    if (_cq_ptr != NULL && _cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr)
+      munmap(_cq_ptr, _cq_sz);
+    if (_sq_ptr != NULL && _sq_ptr != MAP_FAILED)
+      munmap(_sq_ptr, _sq_sz);
+    if (_fd >= 0)
+      close(_fd);
+    _fd = -1;
+    _sq_ptr = _cq_ptr = NULL;
+    _sqes = NULL;
+  }
+
+  int fd() const {
+    return _fd;
+  }
+
+  unsigned space() const {
+    return _sq_entries
+           - (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE));
+  }
+
+  // Returns a zeroed sqe, submitting what is queued when the ring is full.
+  struct io_uring_sqe* get_sqe() {
+    if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)
+        >= _sq_entries) {
+      if (submit_and_wait(0) < 0)
+        return NULL;
+      if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)
+          >= _sq_entries)
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &_sqes[_sqe_tail & _sq_mask];
+    _sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // Submits pending sqes and waits for wait_nr completions, at most
+  // timeout_ns when it is not negative.
+  int submit_and_wait(unsigned wait_nr, long long timeout_ns = -1) {
+    unsigned to_submit = _sqe_tail - _sqe_submitted;
+    __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+    _sqe_submitted = _sqe_tail;
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int r;
+    if (wait_nr > 0 && timeout_ns >= 0) {
+      struct __kernel_timespec ts;
+      ts.tv_sec = timeout_ns / 1000000000LL;
+      ts.tv_nsec = timeout_ns % 1000000000LL;
+      struct io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts = (uint64_t)&ts;
+      r = syscall(__NR_io_uring_enter, _fd, to_submit, wait_nr,
+                  flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+      r = syscall(__NR_io_uring_enter, _fd, to_submit, wait_nr, flags,
+                  NULL, _NSIG / 8);
+    }
+    if (r < 0 && (errno == ETIME || errno == EINTR))
+      return 0;
+    return r;
+  }
+
+  // Calls f(cqe) for every available completion and returns how many.
+  template<class F> unsigned for_each_cqe(F f) {
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; head++, n++)
+      f(_cqes[head & _cq_mask]);
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  // Ring of buffers the kernel picks from for IOSQE_BUFFER_SELECT reads.
+  struct buf_ring_t {
+    struct io_uring_buf_ring* br;
+    unsigned entries;
+    uint16_t tail;
+    buf_ring_t(): br(NULL), entries(0), tail(0) {}
+
+    // Under C++ the header's flex-array wrapper adds an empty struct that
+    // shifts br->bufs by eight bytes, so index the ring as plain entries.
+    void add(void* addr, unsigned len, uint16_t bid) {
+      struct io_uring_buf* b =
+          (struct io_uring_buf*)br + (tail & (entries - 1));
+      b->addr = (uint64_t)addr;
+      b->len = len;
+      b->bid = bid;
+      tail++;
+      __atomic_store_n(&br->tail, tail, __ATOMIC_RELEASE);
+    }
+  };
+
+  // entries must be a power of two.
+  int register_buf_ring(buf_ring_t& ring, unsigned entries, uint16_t bgid) {
+    size_t sz = entries * sizeof(struct io_uring_buf);
+    void* mem = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED)
+      return -1;
+    // fault the pages in before the kernel pins them
+    memset(mem, 0, sz);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)mem;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+      munmap(mem, sz);
+      return -1;
+    }
+    ring.br = (struct io_uring_buf_ring*)mem;
+    ring.entries = entries;
+    ring.tail = 0;
+    return 0;
+  }
+
+  void unregister_buf_ring(buf_ring_t& ring, uint16_t bgid) {
+    if (ring.br == NULL)
+      return;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+    syscall(__NR_io_uring_register, _fd, IORING_UNREGISTER_PBUF_RING,
+            &reg, 1);
+    munmap(ring.br, ring.entries * sizeof(struct io_uring_buf));
+    ring.br = NULL;
+  }
+
+private:
+  int _fail() {
+    exit();
+    return -1;
+  }
+
+  int _fd;
+  void* _sq_ptr;
+  void* _cq_ptr;
+  struct io_uring_sqe* _sqes;
+  size_t _sq_sz;
+  size_t _cq_sz;
+  unsigned* _sq_head;
+  unsigned* _sq_tail;
+  unsigned _sq_mask;
+  unsigned _sq_entries;
+  unsigned* _cq_head;
+  unsigned* _cq_tail;
+  unsigned _cq_mask;
+  struct io_uring_cqe* _cqes;
+  unsigned _sqe_tail;
+  unsigned _sqe_submitted;
+};
+
+#endif
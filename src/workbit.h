@@ -1,22 +1,41 @@
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <new>
 #include <string>
-#include <future>
+#include <chrono>
 #include <cstring>
+#include <cstdlib>
 #include <utility>
 #include <vector>
 #include <list>
-#include <map>
+#include <algorithm>
+#include <type_traits>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <error.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "fdtable.h"
+#include "bufpool.h"
+#include "affinity.h"
+#include "timerwheel.h"
+#include "ringbuf.h"
+#ifdef WORKBIT_IO_URING
+#include <poll.h>
+#include "uring.h"
+#endif
+
 template<class T> class workbit {
 public:
   struct bitstat_t {
@@ -25,11 +44,47 @@ public:
     uint64_t recv_count;
     size_t sent_bytes;
     size_t recv_bytes;
+    uint64_t poll_calls;
+    uint64_t poll_events;
+    uint64_t buf_gets;
+    uint64_t buf_hits;
+    size_t buf_high_water;
     void reset() {
       sent_bytes = recv_bytes = 0;
       send_retry = send_count = recv_count = 0;
+      poll_calls = poll_events = 0;
+      buf_gets = buf_hits = buf_high_water = 0;
+    }
+    bitstat_t& operator+=(const bitstat_t& o) {
+      send_retry += o.send_retry;
+      send_count += o.send_count;
+      recv_count += o.recv_count;
+      sent_bytes += o.sent_bytes;
+      recv_bytes += o.recv_bytes;
+      poll_calls += o.poll_calls;
+      poll_events += o.poll_events;
+      buf_gets += o.buf_gets;
+      buf_hits += o.buf_hits;
+      buf_high_water = std::max(buf_high_water, o.buf_high_water);
+      return *this;
     }
   };
+  struct poll_opt_t {
+    int event_batch;    // max events returned by one epoll_wait
+    int spin_budget;    // empty non-blocking polls before blocking, 0: never spin
+    int busy_poll_usec; // SO_BUSY_POLL on connections, 0: leave unset
+    int recv_buffers;   // io_uring provided receive buffers per reactor
+    size_t buf_size;    // size of the default pooled receive buffers
+    bool buf_hugepages; // back the buffer pools with huge pages
+    // reactor i runs on reactor_cpus[i % size()] and takes its buffers
+    // from that cpu's NUMA node; empty leaves reactors unpinned
+    std::vector<int> reactor_cpus;
+    int command_queue;  // entries of each reactor's command queue, a power of two
+    int connect_timeout_ms; // prepare_connect() gives up after this, 0: never
+    poll_opt_t(): event_batch(256), spin_budget(0), busy_poll_usec(0),
+      recv_buffers(256), buf_size(16384), buf_hugepages(false),
+      command_queue(4096), connect_timeout_ms(0) {}
+  };
   enum fd_state_t {
     STATE_INVALID    = 0,
     STATE_LISTEN     = 1,
@@ -37,6 +92,11 @@ public:
     STATE_CONNECTED  = 3,
     STATE_CTRL       = 4,
   };
+  // connection_t::shutdown_flag bits; SHUT_RD is 0 and cannot be or-ed
+  enum {
+    CLOSED_RD = 1,
+    CLOSED_WR = 2,
+  };
   typedef void(*write_cb_t)(void* parm, int fd, void* data);
   struct write_req_t {
     void* data;
@@ -46,220 +106,1878 @@ public:
     void* parm;
     write_req_t():data(NULL), off(0), len(0), cb(NULL), parm(NULL){}
   };
+  // Immutable payload that can sit on many write queues at once. The
+  // creator holds the first reference, each queued copy holds another and
+  // the memory goes away with the last one. len may be trimmed before the
+  // buffer is handed out.
+  struct shared_buf_t {
+    size_t size;
+    size_t len;
+    void* data;
+    static shared_buf_t* create(size_t size) {
+      void* mem = malloc(sizeof(shared_buf_t) + size);
+      if (mem == NULL)
+        return NULL;
+      shared_buf_t* b = new (mem) shared_buf_t();
+      b->size = b->len = size;
+      b->data = b + 1;
+      b->_refs.store(1, std::memory_order_relaxed);
+      return b;
+    }
+    void ref() {
+      _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void unref() {
+      if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        this->~shared_buf_t();
+        free(this);
+      }
+    }
+  private:
+    std::atomic<int> _refs;
+  };
+  struct reactor_t;
+  struct peer_link_t;
+  typedef uint64_t conn_id_t;
   struct connection_t {
     fd_state_t state;
     int fd;
     int shutdown_flag;
     std::list<write_req_t> write_queue;
     void* extra;
-    connection_t(int _fd, fd_state_t _state):fd(_fd), state(_state),
-      shutdown_flag(0), extra(NULL){}
+    conn_id_t id;
+    reactor_t* reactor;
+    size_t index;       // in reactor->conns
+    peer_link_t* link;  // the managed peer connection it serves, or NULL
+    uint32_t events;
+    size_t pending_bytes;
+    bool throttled;
+    timer_wheel_t<>::node_t timer;  // see set_timer()
+#ifdef WORKBIT_IO_URING
+    int inflight;
+#endif
+    connection_t():state(STATE_INVALID), fd(-1), shutdown_flag(0),
+      extra(NULL), id(0), reactor(NULL), index(0), link(NULL), events(0),
+      pending_bytes(0), throttled(false){
+#ifdef WORKBIT_IO_URING
+      inflight = 0;
+#endif
+    }
+  };
+  // What another thread asks a reactor to do, see _submit().
+  struct command_t {
+    int op;
+    int arg;            // fd_state_t of CMD_ADD, ring op of CMD_POST
+    int fd;
+    conn_id_t id;
+    uint32_t events;
+    size_t len;
+    void* data;
+    write_cb_t cb;
+    void* parm;
+  };
+  typedef ring_buffer_t<command_t, 1, 64, 4096, multi_producer,
+                        yield_wait_t<> > command_ring_t;
+  // command_reg is cache line aligned, which plain new does not honour
+  // before C++17
+  struct reactor_t : aligned_new<alignof(typename command_ring_t::count_t)> {
+    int id;
+    int epfd;
+    int bellfd;         // eventfd, rung once per batch of commands
+    int cpu;            // -1 when not pinned
+    int node;
+    bitstat_t stat;
+    bufpool_t pool;
+    std::thread worker;
+    std::atomic<std::thread::id> thread;  // set by the worker, see _on_reactor()
+    int exit_code;      // what the loop returned, 1 if a drain timed out
+    std::chrono::steady_clock::time_point drain_check;
+    command_ring_t* commands;
+    typename command_ring_t::count_t command_reg;
+    uint_fast64_t command_next;
+    std::atomic<bool> bell;
+    std::vector<conn_id_t> dirty;   // sent to by commands, flushed after them
+    std::vector<int> conns;         // every fd it serves, listeners included
+    timer_wheel_t<> timers;         // in milliseconds of _now_ms()
+#ifdef WORKBIT_IO_URING
+    uring_t ring;
+    uring_t::buf_ring_t buf_ring;
+    std::vector<void*> bufs;
+    std::vector<unsigned> buf_lens;
+    uint8_t ctrl_buf[64];
+    std::vector<int> closing;       // removed fds with sends in flight
+#endif
+    reactor_t(int _id):id(_id), epfd(-1), bellfd(-1), cpu(-1), node(-1),
+      exit_code(0), commands(NULL), command_next(0), bell(false),
+      timers(_now_ms()) {
+      stat.reset();
+    }
+    ~reactor_t() {
+      delete commands;
+    }
+  };
+  struct peer_opt_t {
+    int connections;        // pooled connections, spread over the reactors
+    int connect_timeout_ms; // 0: leave it to the kernel, whatever
+                            // poll_opt_t::connect_timeout_ms says
+    int backoff_min_ms;     // first reconnect delay, doubled per failure
+    int backoff_max_ms;
+    peer_opt_t(): connections(1), connect_timeout_ms(3000),
+      backoff_min_ms(100), backoff_max_ms(30000) {}
+  };
+  struct peer_stat_t {
+    int healthy;                // connections up now
+    uint64_t connects;          // attempts that succeeded
+    uint64_t failures;          // ... and that failed or timed out
+    uint64_t drops;             // established connections lost
+    uint64_t connect_usec;      // how long the last successful one took
+    uint64_t connect_usec_max;
+  };
+  struct peer_t;
+  // One pooled connection of a peer. Its reactor alone connects it and
+  // schedules the retries; other threads only read id.
+  struct peer_link_t {
+    timer_wheel_t<>::node_t retry;  // first member, see _run_timers()
+    peer_t* peer;
+    reactor_t* reactor;
+    std::atomic<conn_id_t> id;      // 0 while down
+    int backoff_ms;
+    uint64_t started_usec;
+    uint32_t seed;                  // for the jitter
+  };
+  struct peer_t {
+    int index;
+    std::string name;
+    std::string host;
+    int port;
+    peer_opt_t opt;
+    peer_link_t* links;             // opt.connections of them
+    std::atomic<unsigned> next;     // where peer_request() looks first
+    std::atomic<uint64_t> connects;
+    std::atomic<uint64_t> failures;
+    std::atomic<uint64_t> drops;
+    std::atomic<uint64_t> connect_usec;
+    std::atomic<uint64_t> connect_usec_max;
   };
-  workbit():_stop(true), _epfd(-1){}
+  workbit():_stop(true), _draining(false), _handed_off(false),
+    _next_reactor(0), _high_watermark(0), _low_watermark(0) {
+    _closed_stat.reset();
+  }
+
+  // Once a connection has high bytes queued request() refuses more with
+  // ENOBUFS; write_resumed() fires when the queue drains to low.
+  // high == 0 leaves queues unbounded.
+  void set_watermarks(size_t high, size_t low) {
+    _high_watermark = high;
+    _low_watermark = std::min(low, high);
+  }
 
-  bool start() {
+  // Bytes queued on fd. Only the reactor serving fd keeps the count, so
+  // call it from that reactor's hooks; on any other thread it returns 0.
+  size_t pending_bytes(int fd) const {
+    const reactor_t* rt = _owner(fd);
+    if (rt == NULL || !_on_reactor(*rt))
+      return 0;
+    connection_t* pconn = _conns.find(fd);
+    return pconn ? pconn->pending_bytes : 0;
+  }
+
+  // Default hooks, hidden by the derived class when it needs its own.
+  // readable() drains the socket through allocate_buf/data/release_buf.
+  int readable(const connection_t& conn) {
+    T* self = static_cast<T*>(this);
+    reactor_t& r = *conn.reactor;
+    for (;;) {
+      size_t len = 0;
+      void* buf = self->allocate_buf(conn.fd, len);
+      if (buf == NULL)
+        return -1;
+      ssize_t n = read(conn.fd, buf, len);
+      if (n > 0) {
+        r.stat.recv_bytes += n;
+        r.stat.recv_count++;
+        self->data(conn, n, buf);
+      }
+      self->release_buf(conn.fd, buf);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+      if (n <= 0)
+        return n;
+      if ((size_t)n < len)
+        return 0;
+    }
+  }
+  int writable(const connection_t& /*conn*/) {
+    return 0;
+  }
+  // Buffers come from the pool of the reactor serving fd and are all
+  // poll_opt_t::buf_size long, whatever len asked for.
+  void* allocate_buf(int fd, size_t& len) {
+    connection_t* pconn = _conns.find(fd);
+    if (pconn == NULL)
+      return NULL;
+    len = pconn->reactor->pool.buf_size();
+    return pconn->reactor->pool.get();
+  }
+  void release_buf(int fd, void* buf) {
+    connection_t* pconn = _conns.find(fd);
+    if (pconn != NULL)
+      pconn->reactor->pool.put(buf);
+  }
+  void write_resumed(const connection_t& /*conn*/) {
+  }
+  void timeout(const connection_t& /*conn*/) {
+  }
+  // A connect that prepare_connect() or a peer started failed; fd is
+  // closed by now. error is ETIMEDOUT past the connect timeout.
+  void connect_failed(int /*fd*/, int /*error*/) {
+  }
+
+  // Takes effect for reactors started after the call.
+  void set_poll_opt(const poll_opt_t& opt) {
+    _poll_opt = opt;
+    if (_poll_opt.event_batch <= 0)
+      _poll_opt.event_batch = 1;
+  }
+
+  // nreactors <= 0 starts one reactor per online cpu.
+  bool start(int nreactors = 1) {
     if (!_stop)
       return true;
-    _stat.reset();
-    _epfd = epoll_create(1); //the input is not used
-    if (_epfd > 0) {
-      _stop = false;
-      std::packaged_task<int(workbit*)> task(_loop);
-      _future_stop = task.get_future();
-      int pair[2] = {0};
-      if ( socketpair(AF_LOCAL, SOCK_STREAM, 0, pair) < 0) {
-        close(_epfd);
+    if (nreactors <= 0)
+      nreactors = std::max(1u, std::thread::hardware_concurrency());
+    const std::vector<int>& cpus = _poll_opt.reactor_cpus;
+    for (size_t i = 0; i < cpus.size(); i++) {
+      if (!cpu_allowed(cpus[i]))
+        return false;
+    }
+    _closed_stat.reset();
+    for (int i = 0; i < nreactors; i++) {
+      reactor_t* r = new reactor_t(i);
+      if (!cpus.empty()) {
+        r->cpu = cpus[i % cpus.size()];
+        r->node = cpu_node(r->cpu);
+      }
+      if (_open_reactor(*r) < 0) {
+        delete r;
+        _close_reactors();
         return false;
-      } else {
-        _readfd = pair[0];
-        _writefd = pair[1];
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        connection_t* pconn = new connection_t(_readfd, STATE_CTRL);
-        ev.data.ptr = pconn;
-        if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _readfd, &ev) < 0) {
-          delete pconn;
-          close(_epfd);
-          close(_readfd);
-          close(_writefd);
-          return -1;
-        }
-        _conns[_readfd] = pconn;
       }
-      std::thread(std::move(task), this).detach();
+      _reactors.push_back(r);
     }
-    return false;
+    _stop = false;
+    for (reactor_t* r : _reactors)
+      r->worker = std::thread(_loop, this, r);
+    return true;
   }
 
+  // Drops whatever is still queued and closes every connection without
+  // calling connection_closed().
   bool stop() {
     _stop = true;
-    write(_writefd, " ", 1);
-    _future_stop.get();
-    close(_epfd);
-    close(_readfd);
-    close(_writefd);
+    for (reactor_t* r : _reactors)
+      _ring_bell(*r);
+    for (reactor_t* r : _reactors)
+      r->worker.join();
+    _close_reactors();
     return true;
   }
 
-  int prepare_listen(const char* host, int port) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) return -1;
+  // Graceful stop. Reactors close their listeners, keep serving until
+  // every connection has sent what it has queued or timeout_ms is up, then
+  // close each one through connection_closed() and exit. Returns false
+  // when some connection still had data queued at the deadline.
+  bool drain(int timeout_ms) {
+    if (_stop)
+      return true;
+    _drain_deadline = std::chrono::steady_clock::now()
+                      + std::chrono::milliseconds(timeout_ms);
+    _draining = true;
+    for (reactor_t* r : _reactors)
+      _ring_bell(*r);
+    bool clean = true;
+    for (reactor_t* r : _reactors) {
+      r->worker.join();
+      if (r->exit_code != 0)
+        clean = false;
+    }
+    _stop = true;
+    _draining = false;
+    _close_reactors();
+    return clean;
+  }
 
-    int flag = 1;
-    if (setsockopt (sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) ) < 0)
+  // Hands every listening socket to the process at the other end of the
+  // AF_UNIX socket sock, which picks them up with adopt_listeners(). The
+  // sockets stay open here too until stop() or drain(), so there is no
+  // moment in which connections are refused. Returns the number sent.
+  int send_listeners(int sock) {
+    std::vector<int> listeners;
+    {
+      std::lock_guard<std::mutex> lock(_listeners_lock);
+      listeners = _listeners;
+    }
+    if (listeners.empty())
+      return 0;
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * listeners.size()));
+    uint32_t count = listeners.size();
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listeners.size());
+    memcpy(CMSG_DATA(cmsg), &listeners[0], sizeof(int) * listeners.size());
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
       return -1;
+    // shutting them down would now stop the successor accepting as well
+    _handed_off = true;
+    return count;
+  }
 
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-
-    if (bind(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) < 0)
+  // Takes over the listening sockets of a predecessor's send_listeners(),
+  // spread over the reactors. Returns the number adopted, or -1 with
+  // EMSGSIZE when more were sent than fit, in which case none is taken and
+  // the predecessor should keep serving.
+  int adopt_listeners(int sock) {
+    enum { MAX_LISTENERS = 256 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_LISTENERS));
+    uint32_t count = 0;
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    if (_reactors.empty() || recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
       return -1;
-
-    listen(sockfd, 5);
- 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    connection_t* pconn = new connection_t(sockfd, STATE_LISTEN);
-    ev.data.ptr = pconn; 
-    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
-      delete pconn;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS)
       return -1;
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    std::vector<int> fds(n);
+    memcpy(&fds[0], CMSG_DATA(cmsg), sizeof(int) * n);
+    if (msg.msg_flags & MSG_CTRUNC) {
+      for (int i = 0; i < n; i++)
+        close(fds[i]);
+      errno = EMSGSIZE;
+      return -1;
+    }
+    int adopted = 0;
+    for (int i = 0; i < n; i++) {
+      reactor_t& r = *_reactors[i % _reactors.size()];
+      if (_add_conn_on(r, fds[i], STATE_LISTEN, EPOLLIN) < 0) {
+        close(fds[i]);
+        continue;
+      }
+      adopted++;
+    }
+    return adopted;
+  }
+
+  // Where reactor i was placed; cpu and node are -1 when it is not pinned.
+  bool reactor_placement(int i, int& cpu, int& node) const {
+    if (i < 0 || (size_t)i >= _reactors.size())
+      return false;
+    cpu = _reactors[i]->cpu;
+    node = _reactors[i]->node;
+    return true;
+  }
+
+  // Generation-tagged handle for fd; 0 when fd is not registered. A handle
+  // taken before the fd was closed and reused no longer matches.
+  conn_id_t conn_id(int fd) const {
+    return _conns.current_id(fd);
+  }
+
+  bool conn_alive(conn_id_t id) const {
+    return _conns.find(id) != NULL;
+  }
+
+  // Opens one SO_REUSEPORT listener per reactor so the kernel spreads
+  // incoming connections across them.
+  int prepare_listen(const char* host, int port) {
+    for (reactor_t* r : _reactors) {
+      if (_listen_on(*r, port) < 0)
+        return -1;
     }
-    _conns[sockfd] = pconn;
     return 0;
   }
 
+  // Returns 1 while the connect is in progress, 0 when it completed at
+  // once; either way connection_made() follows from the reactor.
   int prepare_connect(const char* host, int port) {
-    int c_fd, flags, ret;
+    int c_fd;
     struct sockaddr_in s_addr;
     memset(&s_addr, 0, sizeof(s_addr));
     s_addr.sin_family = AF_INET;
     s_addr.sin_port = htons(port);
     s_addr.sin_addr.s_addr = inet_addr(host);
 
+    if (_reactors.empty())
+      return -1;
+    reactor_t& r = *_reactors[_next_reactor.fetch_add(1,
+        std::memory_order_relaxed) % _reactors.size()];
     if ((c_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
       return -1;
-    if (_setnonblocking(c_fd) < 0)
+    if (_setnonblocking(c_fd) < 0) {
+      close(c_fd);
+      return -1;
+    }
+    int ret = connect(c_fd, (struct sockaddr*)&s_addr, sizeof(s_addr));
+    if (ret < 0 && errno != EINPROGRESS) {
+      close(c_fd);
+      return -1;
+    }
+    // a socket that is already connected reports EPOLLOUT as soon as it
+    // is added, and becomes STATE_CONNECTED the same way
+    if (_add_conn_on(r, c_fd, STATE_CONNECTING,
+                     EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP) < 0) {
+      close(c_fd);
       return -1;
-    ret = connect(c_fd, (struct sockaddr*)&s_addr, sizeof(s_addr));
-    if (ret >= 0)
-      return 0;
-    else if ((ret < 0) && (errno != EINPROGRESS)) {
-      return -1;
-    } else {
-      struct epoll_event ev;
-      ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
-      connection_t *pconn = new connection_t(c_fd, STATE_CONNECTING);
-      ev.data.ptr = pconn;
-      if ( epoll_ctl(_epfd, EPOLL_CTL_ADD, c_fd, &ev) < 0) {
-        delete pconn;
-        close(c_fd);
-        return -1;
-      }
-      return 1;
     }
+    return (ret < 0) ? 1 : 0;
   }
 
+  // Half-closes fd once everything queued before this call is sent.
   int prepare_close(int fd) {
-    if (_conns.find(fd) == _conns.end())
+    reactor_t* rt = _owner(fd);
+    if (rt == NULL)
       return -1;
-
-    connection_t* pconn = _conns[fd];
-    write_req_t req;
-    pconn->write_queue.push_back(req);
+    if (!_on_reactor(*rt))
+      return _submit_fd(*rt, CMD_CLOSE, fd, 0, 0, NULL, NULL, NULL) ? 0 : -1;
+    connection_t* pconn = _conns.find(fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED)
+      return -1;
+    _close_queued(*pconn);
     return 0;
   }
 
+  // cb runs once workbit no longer references data: after the last byte
+  // is sent, or when the connection goes away with the request queued.
+  // Called from a thread other than the connection's reactor, the request
+  // is handed to the reactor and a full command queue fails with EAGAIN.
+  // The watermark is then checked against what the reactor last reported,
+  // so a queue can grow past high by what was in flight; a request taken
+  // this way is always queued, unless the connection closes first.
   int request(int fd, size_t len, void* data, write_cb_t cb, void* parm) {
-    if (_conns.find(fd) == _conns.end()) 
-      return -1;
-
-    connection_t* pconn = _conns[fd];
-    int r = 0;
-    if (pconn->write_queue.size()>0) {
-      r = -1;
-    } else {
-      r = write(fd, data, len);
-    }
-    if (r < 0 || r != len) {
-      if (r < len || errno == EAGAIN || errno == EWOULDBLOCK) {
-        write_req_t req;
-        req.data = data;
-        req.parm = parm;
-        req.cb = cb;
-        req.len = len;
-        req.off = (r > 0) ? r:0;
-        pconn->write_queue.push_back(req);
-        return len;
-      }
-    } else {
-      _stat.sent_bytes += r;
-      cb(parm, fd, data);
+    return _request(fd, 0, len, data, cb, parm);
+  }
+
+  // Keeps opt.connections connections to host:port open, spread over the
+  // reactors. Each reconnects on its own after a failed connect or a
+  // drop, waiting a backoff that doubles per failure and is jittered so
+  // that links which broke together do not retry in step. Peers live
+  // until stop(); add them from the thread that starts workbit. Returns
+  // the index for peer_request() and peer_stat(), or -1 with EAGAIN when
+  // a reactor's command queue had no room to start a link.
+  int add_peer(const char* name, const char* host, int port,
+               const peer_opt_t& opt = peer_opt_t()) {
+    if (_reactors.empty() || opt.connections <= 0
+        || inet_addr(host) == INADDR_NONE)
+      return -1;
+    peer_t* p = new peer_t();
+    p->index = _peers.size();
+    p->name = name;
+    p->host = host;
+    p->port = port;
+    p->opt = opt;
+    if (p->opt.backoff_min_ms <= 0)
+      p->opt.backoff_min_ms = 1;
+    p->opt.backoff_max_ms = std::max(p->opt.backoff_max_ms,
+                                     p->opt.backoff_min_ms);
+    p->next = 0;
+    p->connects = p->failures = p->drops = 0;
+    p->connect_usec = p->connect_usec_max = 0;
+    p->links = new peer_link_t[opt.connections];
+    // Every link's command is claimed before any is published, so a full
+    // queue fails the whole peer instead of leaving links that never start.
+    std::vector<uint_fast64_t> claims(opt.connections);
+    int claimed = 0;
+    for (; claimed < opt.connections; claimed++) {
+      peer_link_t& link = p->links[claimed];
+      link.peer = p;
+      link.reactor = _reactors[_next_reactor.fetch_add(1,
+          std::memory_order_relaxed) % _reactors.size()];
+      link.id = 0;
+      link.backoff_ms = p->opt.backoff_min_ms;
+      link.started_usec = 0;
+      link.seed = (p->index + 1) * 2654435761u + claimed;
+      typename command_ring_t::cursor_t at;
+      if (!_claim(*link.reactor, at))
+        break;
+      claims[claimed] = at.sequence;
+    }
+    const bool started = (claimed == opt.connections);
+    for (int i = 0; i < claimed; i++) {
+      command_t c = command_t();
+      c.op = started ? CMD_PEER : CMD_NOP;
+      c.data = &p->links[i];
+      typename command_ring_t::cursor_t at;
+      at.sequence = claims[i];
+      _publish(*p->links[i].reactor, at, c);
     }
+    if (!started) {
+      delete[] p->links;
+      delete p;
+      errno = EAGAIN;
+      return -1;
+    }
+    _peers.push_back(p);
+    return p->index;
+  }
+
+  int find_peer(const char* name) const {
+    for (size_t i = 0; i < _peers.size(); i++) {
+      if (_peers[i]->name == name)
+        return i;
+    }
+    return -1;
+  }
+
+  // request() on one of the peer's connections that are up, taking them
+  // in turn; one above its high watermark is passed over. Fails with
+  // ENOTCONN when none is up and ENOBUFS when all of them are full.
+  int peer_request(int peer, size_t len, void* data, write_cb_t cb,
+                   void* parm) {
+    if (peer < 0 || (size_t)peer >= _peers.size())
+      return -1;
+    peer_t& p = *_peers[peer];
+    const int n = p.opt.connections;
+    const unsigned first = p.next.fetch_add(1, std::memory_order_relaxed);
+    bool full = false;
+    for (int k = 0; k < n; k++) {
+      conn_id_t id = p.links[(first + k) % n].id.load(
+          std::memory_order_acquire);
+      if (id == 0)
+        continue;
+      int r = _request(fdtable_t<connection_t>::id_fd(id), id, len, data,
+                       cb, parm);
+      if (r >= 0)
+        return r;
+      if (errno == ENOBUFS || errno == EAGAIN)
+        full = true;
+    }
+    errno = full ? ENOBUFS : ENOTCONN;
+    return -1;
+  }
+
+  bool peer_stat(int peer, peer_stat_t& stat) const {
+    if (peer < 0 || (size_t)peer >= _peers.size())
+      return false;
+    const peer_t& p = *_peers[peer];
+    stat.healthy = 0;
+    for (int i = 0; i < p.opt.connections; i++) {
+      if (p.links[i].id.load(std::memory_order_relaxed) != 0)
+        stat.healthy++;
+    }
+    stat.connects = p.connects;
+    stat.failures = p.failures;
+    stat.drops = p.drops;
+    stat.connect_usec = p.connect_usec;
+    stat.connect_usec_max = p.connect_usec_max;
+    return true;
+  }
+
+  // The peer conn was opened for, -1 when it is not a managed one.
+  int conn_peer(const connection_t& conn) const {
+    return conn.link ? conn.link->peer->index : -1;
+  }
+
+
+  // Sends buf on fd without copying it; returns what request() does.
+  int request_shared(int fd, shared_buf_t* buf) {
+    buf->ref();
+    int r = request(fd, buf->len, buf->data, _unref_shared, buf);
+    if (r < 0)
+      buf->unref();
     return r;
   }
 
+  // Fans buf out to every fd in [first, last) and returns how many took
+  // it; a connection above its high watermark misses this one.
+  template<class It> int multicast(It first, It last, shared_buf_t* buf) {
+    int n = 0;
+    for (; first != last; ++first) {
+      if (request_shared(*first, buf) >= 0)
+        n++;
+    }
+    return n;
+  }
+
+  // Queues without attempting a send, so a burst of small messages can go
+  // out in one gathered sendmsg on the next flush(). From another thread
+  // it is turned away with ENOBUFS over the high watermark, as request().
+  int queue_request(int fd, size_t len, void* data, write_cb_t cb,
+                    void* parm) {
+    const uint32_t route = _route(fd);
+    reactor_t* rt = _route_reactor(route);
+    if (rt == NULL)
+      return -1;
+    if (!_on_reactor(*rt)) {
+      if (route & ROUTE_THROTTLED) {
+        errno = ENOBUFS;
+        return -1;
+      }
+      return _submit_fd(*rt, CMD_QUEUE, fd, 0, len, data, cb, parm) ? len : -1;
+    }
+    connection_t* pconn = _conns.find(fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED)
+      return -1;
+    _enqueue(*pconn, len, data, cb, parm, 0);
+    return len;
+  }
+
+  // Returns the number of requests still queued, -1 on a socket error.
+  // From another thread the flush is handed to the reactor and 0 returned.
+  int flush(int fd) {
+    reactor_t* rt = _owner(fd);
+    if (rt == NULL)
+      return -1;
+    if (!_on_reactor(*rt))
+      return _submit_fd(*rt, CMD_FLUSH, fd, 0, 0, NULL, NULL, NULL) ? 0 : -1;
+    connection_t* pconn = _conns.find(fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED)
+      return -1;
+    int n = (pconn->events & EPOLLOUT) ? pconn->write_queue.size()
+                                        : _flush(*pconn);
+    _update_interest(*pconn);
+    return n;
+  }
+
+  // Calls timeout() for fd on its reactor once ms have passed, replacing
+  // the timer set before; each connection has one, so idle reaping and
+  // heartbeats share it. ms < 0 cancels. Resolution is a millisecond.
+  int set_timer(int fd, int ms) {
+    reactor_t* rt = _owner(fd);
+    if (rt == NULL)
+      return -1;
+    if (!_on_reactor(*rt)) {
+      command_t c = command_t();
+      c.op = CMD_TIMER;
+      c.arg = ms;
+      c.fd = fd;
+      return _submit(*rt, c) ? 0 : -1;
+    }
+    connection_t* pconn = _conns.find(fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED)
+      return -1;
+    _set_timer(*pconn, ms);
+    return 0;
+  }
+
+  // The counters are plain fields the reactors bump as they go, so what
+  // another thread reads while they run is approximate. After stop() or
+  // drain() the totals are those of the run that just ended.
   bitstat_t get_stat() const {
-    return _stat;
+    bitstat_t total = _closed_stat;
+    for (size_t i = 0; i < _reactors.size(); i++)
+      total += get_stat(i);
+    return total;
+  }
+
+  bitstat_t get_stat(int reactor) const {
+    return _reactor_stat(*_reactors[reactor]);
+  }
+
+  int reactors() const {
+    return _reactors.size();
   }
 
 private:
+  static bitstat_t _reactor_stat(const reactor_t& r) {
+    bitstat_t stat = r.stat;
+    stat.buf_gets = r.pool.stat().gets;
+    stat.buf_hits = r.pool.stat().hits;
+    stat.buf_high_water = r.pool.stat().high_water;
+    return stat;
+  }
+
   static int _setnonblocking(int fd) {
     int flag = fcntl(fd, F_GETFL, 0);
     if (flag < 0) return -1;
     return fcntl(fd, F_SETFL, flag | O_NONBLOCK);
   }
 
-  static int _loop(workbit* wb) {
-    return wb->__loop();
+  // best effort: raising SO_BUSY_POLL above net.core.busy_read needs
+  // CAP_NET_ADMIN
+  void _set_busy_poll(int fd) {
+    int usec = _poll_opt.busy_poll_usec;
+    if (usec > 0)
+      setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+  }
+
+  static void _unref_shared(void* parm, int /*fd*/, void* /*data*/) {
+    ((shared_buf_t*)parm)->unref();
+  }
+
+  static void _loop(workbit* wb, reactor_t* r) {
+    r->thread.store(std::this_thread::get_id(), std::memory_order_release);
+    if (r->cpu >= 0)
+      pin_thread(r->cpu);
+    r->exit_code = wb->__loop(*r);
+  }
+
+  int _open_reactor(reactor_t& r) {
+    r.pool.init(_poll_opt.buf_size, _poll_opt.buf_hugepages, r.node);
+#ifdef WORKBIT_IO_URING
+    if (_open_ring(r) < 0)
+      return -1;
+#else
+    r.epfd = epoll_create(1); //the input is not used
+    if (r.epfd < 0)
+      return -1;
+#endif
+    try {
+      r.commands = new command_ring_t(_poll_opt.command_queue, r.node);
+    } catch (const std::bad_alloc&) {
+      _close_poller(r);
+      return -1;
+    }
+    r.command_next = r.commands->processor_barrier_register(r.command_reg);
+    r.bellfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r.bellfd < 0) {
+      _close_poller(r);
+      return -1;
+    }
+    if (_add_conn(r, r.bellfd, STATE_CTRL, EPOLLIN) == NULL) {
+      _close_poller(r);
+      close(r.bellfd);
+      return -1;
+    }
+#ifdef WORKBIT_IO_URING
+    if (_fill_ring(r) < 0) {
+      _close_poller(r);
+      _set_route(r.bellfd, 0);
+      _conns.release(r.bellfd);
+      close(r.bellfd);
+      return -1;
+    }
+#endif
+    return 0;
+  }
+
+  void _close_poller(reactor_t& r) {
+#ifdef WORKBIT_IO_URING
+    r.ring.unregister_buf_ring(r.buf_ring, 0);
+    r.ring.exit();
+    for (size_t i = 0; i < r.bufs.size(); i++)
+      static_cast<T*>(this)->release_buf(r.bellfd, r.bufs[i]);
+    r.bufs.clear();
+    r.buf_lens.clear();
+#else
+    close(r.epfd);
+#endif
+  }
+
+  void _close_reactors() {
+    for (reactor_t* r : _reactors) {
+      _drop_commands(*r);
+#ifdef WORKBIT_IO_URING
+      _settle_sends(*r);
+      while (!r->closing.empty())
+        _release_closing(*r, *_conns.find(r->closing.back()));
+#endif
+      _close_poller(*r);
+    }
+    for (reactor_t* r : _reactors) {
+      for (int fd : r->conns) {
+        connection_t& conn = *_conns.find(fd);
+        _drop_queue(conn);
+#ifdef WORKBIT_IO_URING
+        // the ring drops its file references asynchronously after exit;
+        // leave the reuseport group now rather than when that finishes
+        if (conn.state == STATE_LISTEN && !_handed_off)
+          shutdown(fd, SHUT_RDWR);
+#endif
+        close(fd);
+        _set_route(fd, 0);
+        _conns.release(fd);
+      }
+      _closed_stat += _reactor_stat(*r);
+      delete r;
+    }
+    _reactors.clear();
+    for (peer_t* p : _peers) {
+      delete[] p->links;
+      delete p;
+    }
+    _peers.clear();
+    {
+      std::lock_guard<std::mutex> lock(_listeners_lock);
+      _listeners.clear();
+    }
+    _handed_off = false;
+  }
+
+  int _listen_on(reactor_t& r, int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+
+    int flag = 1;
+    if (setsockopt (sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) ) < 0
+        || setsockopt (sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) {
+      close(sockfd);
+      return -1;
+    }
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) < 0) {
+      close(sockfd);
+      return -1;
+    }
+
+    listen(sockfd, 5);
+ 
+    if (_add_conn_on(r, sockfd, STATE_LISTEN, EPOLLIN) < 0) {
+      close(sockfd);
+      return -1;
+    }
+    return 0;
+  }
+
+  connection_t* _add_conn(reactor_t& r, int fd, fd_state_t state,
+                          uint32_t events) {
+    conn_id_t id;
+    connection_t* pconn = _conns.acquire(fd, id);
+    if (pconn == NULL)
+      return NULL;
+    pconn->fd = fd;
+    pconn->state = state;
+    pconn->id = id;
+    pconn->reactor = &r;
+    pconn->events = events;
+#ifdef WORKBIT_IO_URING
+    _post(r, id, OP_ARM);
+#else
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = id;
+    if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      _conns.release(fd);
+      return NULL;
+    }
+#endif
+    pconn->index = r.conns.size();
+    r.conns.push_back(fd);
+    _set_route(fd, _make_route(r, false));
+    if (state == STATE_LISTEN) {
+      // only once it is served, as a deferred add can still fail
+      std::lock_guard<std::mutex> lock(_listeners_lock);
+      _listeners.push_back(fd);
+    }
+    if (state == STATE_CONNECTING && _poll_opt.connect_timeout_ms > 0)
+      _set_timer(*pconn, _poll_opt.connect_timeout_ms);
+    return pconn;
+  }
+
+  // _add_conn() from any thread; 1 when left to the reactor.
+  int _add_conn_on(reactor_t& r, int fd, fd_state_t state, uint32_t events) {
+    if (!_on_reactor(r)) {
+      command_t c = command_t();
+      c.op = CMD_ADD;
+      c.arg = state;
+      c.fd = fd;
+      c.events = events;
+      return _submit(r, c) ? 1 : -1;
+    }
+    return (_add_conn(r, fd, state, events) != NULL) ? 0 : -1;
+  }
+
+  void _del_conn(reactor_t& r, connection_t* pconn) {
+    int fd = pconn->fd;
+    r.timers.cancel(pconn->timer);
+    if (pconn->link != NULL)
+      _link_down(r, *pconn->link, pconn->state == STATE_CONNECTED);
+    const int moved = r.conns.back();
+    r.conns[pconn->index] = moved;
+    _conns.find(moved)->index = pconn->index;
+    r.conns.pop_back();
+    if (pconn->state == STATE_LISTEN) {
+      std::lock_guard<std::mutex> lock(_listeners_lock);
+      _listeners.erase(std::find(_listeners.begin(), _listeners.end(), fd));
+    }
+    _set_route(fd, 0);
+#ifdef WORKBIT_IO_URING
+    _cancel(r, fd);
+    if (pconn->inflight > 0) {
+      // The kernel may still be reading the buffers of the sends in
+      // flight, so the queue, the slot and the fd stay until the last of
+      // them completes, see _send_done(). A send the cancel cannot stop
+      // fails once the socket is shut down.
+      pconn->state = STATE_INVALID;
+      shutdown(fd, SHUT_RDWR);
+      r.closing.push_back(fd);
+      return;
+    }
+#else
+    epoll_ctl(r.epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    pconn->state = STATE_INVALID;
+    _drop_queue(*pconn);
+    _conns.release(fd);
+    close(fd);
   }
 
-  int __loop() {
-    struct epoll_event evs[1000];
-    int status, err;
-    socklen_t len = sizeof(err);
+  // With a spin budget the reactor keeps polling with a zero timeout after
+  // each burst and only blocks once that many polls in a row came back
+  // empty, trading a core for wake-up latency.
+#ifndef WORKBIT_IO_URING
+  int __loop(reactor_t& r) {
+    const poll_opt_t opt = _poll_opt;
+    std::vector<epoll_event> evs(opt.event_batch);
+    int idle = 0;
     while ( ! _stop ) {
-      int n = epoll_wait( _epfd, evs, 20, -1);
+      int timeout = (idle < opt.spin_budget) ? 0 : -1;
+      if (_draining) {
+        timeout = _drain_tick(r);
+        if (timeout < 0)
+          return r.exit_code;
+      }
+      timeout = _timer_timeout(r, timeout);
+      int n = epoll_wait( r.epfd, &evs[0], opt.event_batch, timeout);
+      r.stat.poll_calls++;
+      _run_timers(r);
+      if (n <= 0) {
+        idle++;
+        continue;
+      }
+      idle = 0;
+      r.stat.poll_events += n;
       for (int i = 0; i<n; i++) {
         epoll_event& ev = evs[i];
-        connection_t* pconn = (connection_t*)ev.data.ptr;
+        // an earlier event in this batch may have closed the fd and the
+        // kernel may already have reused it; the generation tells them apart
+        connection_t* pconn = _conns.find((conn_id_t)ev.data.u64);
+        if (pconn == NULL)
+          continue;
         switch (pconn->state) {
-        case STATE_CONNECTED: _handle_connected(ev); break;
-        case STATE_LISTEN: _handle_listen(ev); break;
-        case STATE_CONNECTING: _handle_connecting(ev); break;
-        case STATE_CTRL: _handle_ctrl(ev); break;
+        case STATE_CONNECTED: _handle_connected(r, *pconn, ev.events); break;
+        case STATE_LISTEN: _handle_listen(r, *pconn); break;
+        case STATE_CONNECTING: _handle_connecting(r, *pconn, ev.events); break;
+        case STATE_CTRL: _handle_ctrl(r); break;
+        case STATE_INVALID: break;
         }
       }
     }
-    for (std::pair<int, connection_t*> item :_conns) {
-      delete item.second;
-      close(item.first);
+    return 0;
+  }
+#else
+  enum {
+    OP_ARM    = 1,
+    OP_SEND   = 2,
+    OP_RECV   = 3,
+    OP_ACCEPT = 4,
+    OP_POLL   = 5,
+    OP_CTRL   = 6,
+  };
+  enum { SEND_CHAIN_MAX = 32 };
+  static const uint64_t TAG_MASK = (1ULL << 56) - 1;
+
+  // user_data carries the op in the top byte and the connection id, with
+  // its generation cut to 24 bits, below it.
+  static uint64_t _tag(conn_id_t id, int op) {
+    return ((uint64_t)op << 56) | (id & TAG_MASK);
+  }
+
+  connection_t* _tagged_conn(uint64_t tag) {
+    connection_t* pconn = _conns.find(
+        fdtable_t<connection_t>::id_fd(tag & TAG_MASK));
+    if (pconn == NULL || (pconn->id & TAG_MASK) != (tag & TAG_MASK))
+      return NULL;
+    return pconn;
+  }
+
+  int _open_ring(reactor_t& r) {
+    if (r.ring.init(std::max(_poll_opt.event_batch, 2 * SEND_CHAIN_MAX)) < 0)
+      return -1;
+    unsigned n = 1;
+    while (n < (unsigned)_poll_opt.recv_buffers && n < 32768)
+      n <<= 1;
+    if (r.ring.register_buf_ring(r.buf_ring, n, 0) < 0) {
+      r.ring.exit();
+      return -1;
+    }
+    return 0;
+  }
+
+  // Receive buffers are allocated for the control fd once per reactor and
+  // lent to the kernel through the provided buffer ring.
+  int _fill_ring(reactor_t& r) {
+    for (unsigned i = 0; i < r.buf_ring.entries; i++) {
+      size_t len = 0;
+      void* buf = static_cast<T*>(this)->allocate_buf(r.bellfd, len);
+      if (buf == NULL)
+        return -1;
+      r.bufs.push_back(buf);
+      r.buf_lens.push_back(len);
+      r.buf_ring.add(buf, len, i);
     }
-    _conns.clear();
     return 0;
   }
 
-  int _cleanup_connection(connection_t* pconn, int flag) {
+  // The ring belongs to the reactor thread; other threads go through the
+  // command queue.
+  void _post(reactor_t& r, conn_id_t id, int op) {
+    if (_on_reactor(r)) {
+      _dispatch(r, id, op);
+      return;
+    }
+    command_t c = command_t();
+    c.op = CMD_POST;
+    c.arg = op;
+    c.id = id;
+    _submit(r, c);
+  }
+
+  void _dispatch(reactor_t& r, conn_id_t id, int op) {
+    connection_t* pconn = _conns.find(id);
+    if (pconn == NULL)
+      return;
+    if (op == OP_SEND)
+      _submit_send(r, *pconn);
+    else
+      _arm(r, *pconn);
+  }
+
+  void _arm(reactor_t& r, connection_t& conn) {
+    struct io_uring_sqe* sqe = r.ring.get_sqe();
+    if (sqe == NULL)
+      return;
+    sqe->fd = conn.fd;
+    switch (conn.state) {
+    case STATE_LISTEN:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = _tag(conn.id, OP_ACCEPT);
+      break;
+    case STATE_CONNECTING:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLOUT;
+      sqe->user_data = _tag(conn.id, OP_POLL);
+      break;
+    case STATE_CONNECTED:
+      sqe->opcode = IORING_OP_RECV;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      sqe->user_data = _tag(conn.id, OP_RECV);
+      break;
+    case STATE_CTRL:
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (uint64_t)r.ctrl_buf;
+      sqe->len = sizeof(r.ctrl_buf);
+      sqe->user_data = _tag(conn.id, OP_CTRL);
+      break;
+    default:
+      sqe->opcode = IORING_OP_NOP;
+      break;
+    }
+  }
+
+  // Queued buffers go out as a chain of linked sends. MSG_WAITALL turns a
+  // short send into a failure, which cancels the rest of the chain, so
+  // later buffers never overtake an earlier one.
+  void _submit_send(reactor_t& r, connection_t& conn) {
+    std::list<write_req_t>& q = conn.write_queue;
+    if (conn.inflight > 0)
+      return;
+    while (!q.empty() && q.front().data == NULL) {
+      q.pop_front();
+      shutdown(conn.fd, SHUT_WR);
+      conn.shutdown_flag |= CLOSED_WR;
+    }
+    int n = 0;
+    for (typename std::list<write_req_t>::iterator it = q.begin();
+         it != q.end() && it->data != NULL && n < SEND_CHAIN_MAX; ++it)
+      n++;
+    if (n > 0 && r.ring.space() < (unsigned)n)
+      r.ring.submit_and_wait(0);
+    typename std::list<write_req_t>::iterator it = q.begin();
+    for (int i = 0; i < n; i++, ++it) {
+      struct io_uring_sqe* sqe = r.ring.get_sqe();
+      if (sqe == NULL)
+        break;
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = conn.fd;
+      sqe->addr = (uint64_t)((uint8_t*)it->data + it->off);
+      sqe->len = it->len - it->off;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      sqe->user_data = _tag(conn.id, OP_SEND);
+      if (i + 1 < n)
+        sqe->flags = IOSQE_IO_LINK;
+      conn.inflight++;
+    }
+    if (conn.inflight == 0)
+      conn.events &= ~EPOLLOUT;
+  }
+
+  void _send_done(reactor_t& r, connection_t& conn, int res) {
+    std::list<write_req_t>& q = conn.write_queue;
+    conn.inflight--;
+    if (conn.state == STATE_INVALID) {
+      // removed by _del_conn() with sends in flight
+      if (conn.inflight == 0)
+        _release_closing(r, conn);
+      return;
+    }
+    if (res > 0) {
+      r.stat.sent_bytes += res;
+      conn.pending_bytes -= res;
+      q.front().off += res;
+      if (q.front().off == q.front().len) {
+        write_req_t req = q.front();
+        q.pop_front();
+        r.stat.send_count++;
+        if (req.cb)
+          req.cb(req.parm, conn.fd, req.data);
+      }
+    } else if (res < 0 && res != -ECANCELED) {
+      static_cast<T*>(this)->connection_closed(conn);
+      _del_conn(r, &conn);
+      return;
+    }
+    if (conn.inflight > 0)
+      return;
+    _submit_send(r, conn);
+    if (conn.inflight > 0)
+      return;
+    _check_resume(conn);
+    static_cast<T*>(this)->writable(conn);
+    if (conn.shutdown_flag != 0)
+      _cleanup_connection(r, &conn, 0);
+  }
+
+  void _recv_done(reactor_t& r, connection_t* pconn,
+                  const struct io_uring_cqe& cqe) {
+    void* buf = NULL;
+    unsigned bid = 0;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      buf = r.bufs[bid];
+    }
+    if (pconn != NULL && buf != NULL && cqe.res > 0) {
+      r.stat.recv_bytes += cqe.res;
+      r.stat.recv_count++;
+      static_cast<T*>(this)->data(*pconn, cqe.res, buf);
+    }
+    if (buf != NULL)
+      r.buf_ring.add(buf, r.buf_lens[bid], bid);
+    if (pconn == NULL)
+      return;
+    if (cqe.res == 0) {
+      _cleanup_connection(r, pconn, CLOSED_RD);
+    } else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+      static_cast<T*>(this)->connection_closed(*pconn);
+      _del_conn(r, pconn);
+    } else if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      _arm(r, *pconn);
+    }
+  }
+
+  void _complete(reactor_t& r, const struct io_uring_cqe& cqe) {
+    int op = cqe.user_data >> 56;
+    connection_t* pconn = _tagged_conn(cqe.user_data);
+    // a connection waiting out its sends only hears about those
+    if (pconn != NULL && pconn->state == STATE_INVALID && op != OP_SEND)
+      pconn = NULL;
+    switch (op) {
+    case OP_RECV:
+      _recv_done(r, pconn, cqe);
+      break;
+    case OP_SEND:
+      if (pconn != NULL)
+        _send_done(r, *pconn, cqe.res);
+      break;
+    case OP_ACCEPT:
+      if (cqe.res >= 0) {
+        struct sockaddr_in client_addr;
+        socklen_t len = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(cqe.res, (struct sockaddr*)&client_addr, &len);
+        _accepted(r, cqe.res, client_addr);
+      }
+      if (pconn != NULL && !(cqe.flags & IORING_CQE_F_MORE))
+        _arm(r, *pconn);
+      break;
+    case OP_POLL:
+      if (pconn != NULL && pconn->state == STATE_CONNECTING)
+        _handle_connecting(r, *pconn, (cqe.res < 0) ? (uint32_t)EPOLLERR
+                                                    : (uint32_t)cqe.res);
+      break;
+    case OP_CTRL:
+      _run_commands(r);
+      if (pconn != NULL)
+        _arm(r, *pconn);
+      break;
+    }
+  }
+
+  // In-flight requests pin the file, so they are cancelled before the fd
+  // number is given back. Cancelling only asks; a send is done with its
+  // buffer once its own completion arrives.
+  void _cancel(reactor_t& r, int fd) {
+    struct io_uring_sqe* sqe = r.ring.get_sqe();
+    if (sqe == NULL)
+      return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    r.ring.submit_and_wait(0);
+  }
+
+  void _release_closing(reactor_t& r, connection_t& conn) {
+    const int fd = conn.fd;
+    r.closing.erase(std::find(r.closing.begin(), r.closing.end(), fd));
+    _drop_queue(conn);
+    _conns.release(fd);
+    close(fd);
+  }
+
+  // Before a stopped reactor's ring goes away: every socket with sends in
+  // flight is shut down and their completions are waited for, so that no
+  // buffer is given back while the kernel may still read it. Everything
+  // else that completes meanwhile is dropped.
+  void _settle_sends(reactor_t& r) {
+    int inflight = 0;
+    for (int fd : r.conns) {
+      connection_t& conn = *_conns.find(fd);
+      if (conn.inflight > 0)
+        shutdown(fd, SHUT_RDWR);
+      inflight += conn.inflight;
+    }
+    for (int fd : r.closing)
+      inflight += _conns.find(fd)->inflight;
+    if (inflight == 0)
+      return;
+    struct io_uring_sqe* sqe = r.ring.get_sqe();
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    while (inflight > 0) {
+      if (r.ring.submit_and_wait(1) < 0)
+        break;
+      r.ring.for_each_cqe([this, &inflight](const struct io_uring_cqe& cqe) {
+        const int op = cqe.user_data >> 56;
+        connection_t* pconn = _tagged_conn(cqe.user_data);
+        if (op == OP_SEND && pconn != NULL) {
+          pconn->inflight--;
+          inflight--;
+        } else if (op == OP_ACCEPT && cqe.res >= 0) {
+          close(cqe.res);
+        }
+      });
+    }
+  }
+
+  int __loop(reactor_t& r) {
+    const poll_opt_t opt = _poll_opt;
+    _run_commands(r);
+    int idle = 0;
+    while ( ! _stop ) {
+      int timeout = (idle < opt.spin_budget) ? 0 : -1;
+      if (_draining) {
+        timeout = _drain_tick(r);
+        if (timeout < 0)
+          return r.exit_code;
+      }
+      timeout = _timer_timeout(r, timeout);
+      if (timeout == 0)
+        r.ring.submit_and_wait(0);
+      else
+        r.ring.submit_and_wait(1, (timeout > 0) ? timeout * 1000000LL : -1);
+      r.stat.poll_calls++;
+      _run_timers(r);
+      unsigned n = r.ring.for_each_cqe([this, &r](
+            const struct io_uring_cqe& cqe) { _complete(r, cqe); });
+      if (n == 0) {
+        idle++;
+        continue;
+      }
+      idle = 0;
+      r.stat.poll_events += n;
+    }
+    return 0;
+  }
+#endif
+
+
+  // fd, or the connection id when it is not 0, from any thread
+  int _request(int fd, conn_id_t id, size_t len, void* data, write_cb_t cb,
+               void* parm) {
+    const uint32_t route = _route(fd);
+    reactor_t* rt = _route_reactor(route);
+    if (rt == NULL)
+      return -1;
+    if (!_on_reactor(*rt)) {
+      if (route & ROUTE_THROTTLED) {
+        errno = ENOBUFS;
+        return -1;
+      }
+      return _submit_fd(*rt, CMD_SEND, fd, id, len, data, cb, parm) ? len : -1;
+    }
+    connection_t* pconn = (id != 0) ? _conns.find(id) : _conns.find(fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED)
+      return -1;
+    if (_high_watermark > 0 && pconn->pending_bytes >= _high_watermark) {
+      _set_throttled(*pconn, true);
+      errno = ENOBUFS;
+      return -1;
+    }
+    ssize_t r = 0;
+    bool tried = pconn->write_queue.empty();
+    if (tried) {
+      r = send(fd, data, len, MSG_NOSIGNAL);
+      if (r == (ssize_t)len) {
+        rt->stat.sent_bytes += r;
+        rt->stat.send_count++;
+        if (cb)
+          cb(parm, fd, data);
+        return r;
+      }
+      if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      if (r > 0)
+        rt->stat.sent_bytes += r;
+      rt->stat.send_retry++;
+    }
+    _enqueue(*pconn, len, data, cb, parm, (r > 0) ? r : 0);
+    if (!tried && !(pconn->events & EPOLLOUT))
+      _flush(*pconn);
+    _update_interest(*pconn);
+    return len;
+  }
+
+  void _enqueue(connection_t& conn, size_t len, void* data, write_cb_t cb,
+                void* parm, size_t off) {
+    write_req_t req;
+    req.data = data;
+    req.parm = parm;
+    req.cb = cb;
+    req.len = len;
+    req.off = off;
+    conn.write_queue.push_back(req);
+    conn.pending_bytes += len - off;
+  }
+
+  void _drop_queue(connection_t& conn) {
+    conn.pending_bytes = 0;
+    while (!conn.write_queue.empty()) {
+      write_req_t req = conn.write_queue.front();
+      conn.write_queue.pop_front();
+      if (req.data != NULL && req.cb != NULL)
+        req.cb(req.parm, conn.fd, req.data);
+    }
+  }
+
+  // Gathers up to IOV_MAX queued buffers per sendmsg, resuming each from
+  // its offset, until the queue is empty or the socket stops taking data.
+  // A request without data marks a pending prepare_close().
+  int _flush(connection_t& conn) {
+    reactor_t& r = *conn.reactor;
+    struct iovec iov[IOV_MAX];
+    std::list<write_req_t>& q = conn.write_queue;
+    while (!q.empty()) {
+      if (q.front().data == NULL) {
+        q.pop_front();
+        shutdown(conn.fd, SHUT_WR);
+        conn.shutdown_flag |= CLOSED_WR;
+        continue;
+      }
+      int n = 0;
+      size_t want = 0;
+      for (typename std::list<write_req_t>::iterator it = q.begin();
+           it != q.end() && it->data != NULL && n < IOV_MAX; ++it) {
+        iov[n].iov_base = (uint8_t*)it->data + it->off;
+        iov[n].iov_len = it->len - it->off;
+        want += iov[n].iov_len;
+        n++;
+      }
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n;
+      ssize_t w = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+      if (w < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return -1;
+      }
+      r.stat.sent_bytes += w;
+      conn.pending_bytes -= w;
+      size_t done = w;
+      while (!q.empty() && q.front().data != NULL
+             && done >= q.front().len - q.front().off) {
+        write_req_t req = q.front();
+        done -= req.len - req.off;
+        q.pop_front();
+        r.stat.send_count++;
+        if (req.cb)
+          req.cb(req.parm, conn.fd, req.data);
+      }
+      if (done > 0)
+        q.front().off += done;
+      if ((size_t)w < want)
+        break;
+    }
+    _check_resume(conn);
+    return q.size();
+  }
+
+  void _check_resume(connection_t& conn) {
+    if (conn.throttled && conn.pending_bytes <= _low_watermark) {
+      _set_throttled(conn, false);
+      static_cast<T*>(this)->write_resumed(conn);
+    }
+  }
+
+#ifdef WORKBIT_IO_URING
+  // The EPOLLOUT bit of connection_t::events marks a send chain scheduled
+  // or in flight on the ring.
+  void _update_interest(connection_t& conn) {
+    if (conn.write_queue.empty() || (conn.events & EPOLLOUT))
+      return;
+    conn.events |= EPOLLOUT;
+    _post(*conn.reactor, conn.id, OP_SEND);
+  }
+#else
+  // EPOLLOUT is only armed while data is queued, so an idle connection
+  // does not wake the reactor every time its send buffer drains.
+  void _update_interest(connection_t& conn) {
+    uint32_t want = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if (!conn.write_queue.empty())
+      want |= EPOLLOUT;
+    if (want == conn.events)
+      return;
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.u64 = conn.id;
+    if (epoll_ctl(conn.reactor->epfd, EPOLL_CTL_MOD, conn.fd, &ev) == 0)
+      conn.events = want;
+  }
+#endif
+
+  // Once the peer stopped sending, the connection is kept only until the
+  // write queue drains or our side is shut down as well.
+  int _cleanup_connection(reactor_t& r, connection_t* pconn, int flag) {
     pconn->shutdown_flag |= flag;
-    if (pconn->shutdown_flag == (SHUT_RD | SHUT_WR)) {
-      _conns.erase(pconn->fd);
-      close(pconn->fd);
-      delete pconn;
+    if ((pconn->shutdown_flag & CLOSED_RD)
+        && ((pconn->shutdown_flag & CLOSED_WR) || pconn->write_queue.empty())) {
+      static_cast<T*>(this)->connection_closed(*pconn);
+      _del_conn(r, pconn);
       return 0;
     }
     return pconn->fd;
   }
-  int _handle_ctrl(epoll_event& ev) {
-    uint8_t bv;
-    read(_readfd, &bv, 1);
-    _stop = true;
+  // stop() and drain() only ring the bell; the loop sees their flags.
+  int _handle_ctrl(reactor_t& r) {
+    uint64_t rings;
+    read(r.bellfd, &rings, sizeof(rings));
+    _run_commands(r);
+    return 0;
+  }
+
+  enum {
+    CMD_NOP   = 0,  // a claimed entry given back, see add_peer()
+    CMD_ADD   = 1,  // _add_conn(), closing fd if that fails
+    CMD_SEND  = 2,  // request()
+    CMD_QUEUE = 3,  // queue_request()
+    CMD_FLUSH = 4,
+    CMD_CLOSE = 5,  // prepare_close()
+    CMD_POST  = 6,  // _post()
+    CMD_TIMER = 7,  // set_timer()
+    CMD_PEER  = 8,  // connect a peer link
+  };
+  // A connection's route says which reactor serves it without touching
+  // its slot; it is the word fdtable_t keeps beside the slot. 0 when none
+  // does, else the reactor id + 1 shifted up by one,
+  // with ROUTE_THROTTLED or-ed in while it is above the high watermark.
+  // Only that reactor writes it, as the fd is added and removed and as
+  // its queue crosses the watermarks.
+  enum { ROUTE_THROTTLED = 1 };
+
+  static uint32_t _make_route(const reactor_t& r, bool throttled) {
+    return ((uint32_t)(r.id + 1) << 1) | (throttled ? ROUTE_THROTTLED : 0);
+  }
+
+  uint32_t _route(int fd) const {
+    return _conns.word(fd);
+  }
+
+  void _set_route(int fd, uint32_t route) {
+    _conns.set_word(fd, route);
+  }
+
+  reactor_t* _route_reactor(uint32_t route) const {
+    return (route != 0) ? _reactors[(route >> 1) - 1] : NULL;
+  }
+
+  reactor_t* _owner(int fd) const {
+    return _route_reactor(_route(fd));
+  }
+
+  void _set_throttled(connection_t& conn, bool throttled) {
+    conn.throttled = throttled;
+    _set_route(conn.fd, _make_route(*conn.reactor, throttled));
+  }
+
+  // Other threads may still see the id unset, which tells them apart
+  // from the reactor just as well.
+  bool _on_reactor(const reactor_t& r) const {
+    return std::this_thread::get_id()
+           == r.thread.load(std::memory_order_acquire);
+  }
+
+  // The first command after the reactor took the last batch writes the
+  // eventfd; the rest find the bell already rung.
+  void _ring_bell(reactor_t& r) {
+    if (!r.bell.exchange(true, std::memory_order_acq_rel)) {
+      uint64_t one = 1;
+      write(r.bellfd, &one, sizeof(one));
+    }
+  }
+
+  // Any number of threads publish to a reactor's queue; the reactor is
+  // its only processor. Never blocks on a full queue, since reactors
+  // submit to each other, and fails with EAGAIN only when it is full.
+  bool _submit(reactor_t& r, const command_t& c) {
+    typename command_ring_t::cursor_t at;
+    if (!_claim(r, at))
+      return false;
+    _publish(r, at, c);
+    return true;
+  }
+
+  // A claimed entry holds up the commands claimed after it until it is
+  // published, so _publish() must follow soon, in claim order.
+  bool _claim(reactor_t& r, typename command_ring_t::cursor_t& at) {
+    if (!r.commands->publisher_next_entry_nonblocking(at)) {
+      errno = EAGAIN;
+      return false;
+    }
+    return true;
   }
 
-  int _handle_listen(epoll_event& ev) {
-    connection_t& lconn = *(connection_t*)ev.data.ptr;
+  void _publish(reactor_t& r, typename command_ring_t::cursor_t& at,
+                const command_t& c) {
+    r.commands->processor_acquire_entry(at).content = c;
+    r.commands->publisher_commit_entry_blocking(at);
+    _ring_bell(r);
+  }
+
+  bool _submit_fd(reactor_t& r, int op, int fd, conn_id_t id, size_t len,
+                  void* data, write_cb_t cb, void* parm) {
+    command_t c = command_t();
+    c.op = op;
+    c.fd = fd;
+    c.id = id;
+    c.len = len;
+    c.data = data;
+    c.cb = cb;
+    c.parm = parm;
+    return _submit(r, c);
+  }
+
+  // Takes what is queued now; later commands ring the bell again. Sends
+  // are only queued while the batch runs and go out in one gathered
+  // flush per connection after it.
+  void _run_commands(reactor_t& r) {
+    r.bell.exchange(false, std::memory_order_acq_rel);
+    typename command_ring_t::cursor_t last;
+    last.sequence = r.command_next;
+    if (!r.commands->processor_barrier_wait_nonblocking(last))
+      return;
+    typename command_ring_t::cursor_t at;
+    for (at.sequence = r.command_next; at.sequence <= last.sequence;
+         ++at.sequence) {
+      command_t c = r.commands->show_entry(at).content;
+      _run_command(r, c);
+    }
+    r.commands->processor_barrier_release_entry(r.command_reg, last);
+    r.command_next = last.sequence + 1;
+    for (size_t i = 0; i < r.dirty.size(); i++) {
+      connection_t* pconn = _conns.find(r.dirty[i]);
+      if (pconn == NULL || pconn->state != STATE_CONNECTED)
+        continue;
+      if (!(pconn->events & EPOLLOUT))
+        _flush(*pconn);
+      _update_interest(*pconn);
+    }
+    r.dirty.clear();
+  }
+
+  void _run_command(reactor_t& r, const command_t& c) {
+    if (c.op == CMD_NOP)
+      return;
+    if (c.op == CMD_ADD) {
+      if (_add_conn(r, c.fd, (fd_state_t)c.arg, c.events) == NULL)
+        close(c.fd);
+      return;
+    }
+    if (c.op == CMD_PEER) {
+      _link_connect(r, *(peer_link_t*)c.data);
+      return;
+    }
+#ifdef WORKBIT_IO_URING
+    if (c.op == CMD_POST) {
+      _dispatch(r, c.id, c.arg);
+      return;
+    }
+#endif
+    // The fd may have been closed since the submit, and may even be served
+    // by another reactor now; only a slot of this reactor's is looked at.
+    // A request for a connection that is gone is given back through its cb,
+    // as when the connection closes with it queued. The watermark was
+    // checked on submit, and a request taken then is not turned down here.
+    connection_t* pconn = NULL;
+    if (_owner(c.fd) == &r)
+      pconn = (c.id != 0) ? _conns.find(c.id) : _conns.find(c.fd);
+    if (pconn == NULL || pconn->state != STATE_CONNECTED) {
+      if (c.cb)
+        c.cb(c.parm, c.fd, c.data);
+      return;
+    }
+    switch (c.op) {
+    case CMD_SEND:
+    case CMD_QUEUE:
+      if (c.op == CMD_SEND && (r.dirty.empty() || r.dirty.back() != pconn->id))
+        r.dirty.push_back(pconn->id);
+      _enqueue(*pconn, c.len, c.data, c.cb, c.parm, 0);
+      // lets other threads turn requests away before they are queued
+      if (_high_watermark > 0 && pconn->pending_bytes >= _high_watermark)
+        _set_throttled(*pconn, true);
+      break;
+    case CMD_FLUSH:
+      if (!(pconn->events & EPOLLOUT))
+        _flush(*pconn);
+      _update_interest(*pconn);
+      break;
+    case CMD_CLOSE:
+      _close_queued(*pconn);
+      break;
+    case CMD_TIMER:
+      _set_timer(*pconn, c.arg);
+      break;
+    }
+  }
+
+  // For reactors that are gone: what commands still hold is given back.
+  void _drop_commands(reactor_t& r) {
+    typename command_ring_t::cursor_t last;
+    last.sequence = r.command_next;
+    if (!r.commands->processor_barrier_wait_nonblocking(last))
+      return;
+    typename command_ring_t::cursor_t at;
+    for (at.sequence = r.command_next; at.sequence <= last.sequence;
+         ++at.sequence) {
+      const command_t& c = r.commands->show_entry(at).content;
+      if (c.op == CMD_ADD)
+        close(c.fd);
+      else if (c.cb)
+        c.cb(c.parm, c.fd, c.data);
+    }
+    r.commands->processor_barrier_release_entry(r.command_reg, last);
+    r.command_next = last.sequence + 1;
+  }
+
+  static uint64_t _now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void _set_timer(connection_t& conn, int ms) {
+    timer_wheel_t<>& timers = conn.reactor->timers;
+    if (ms < 0) {
+      timers.cancel(conn.timer);
+      return;
+    }
+    conn.timer.tag = conn.id;
+    timers.schedule(conn.timer, _now_ms() + ms);
+  }
+
+  // Shortens the poll timeout to the next timer tick.
+  int _timer_timeout(reactor_t& r, int timeout) {
+    if (timeout == 0)
+      return 0;
+    uint64_t next = r.timers.next_tick();
+    if (next == UINT64_MAX)
+      return timeout;
+    uint64_t now = _now_ms();
+    uint64_t wait = (next > now) ? next - now : 0;
+    if (timeout > 0 && wait >= (uint64_t)timeout)
+      return timeout;
+    return (wait > INT_MAX) ? INT_MAX : (int)wait;
+  }
+
+  // A connection still connecting when its timer runs out has hit its
+  // connect timeout. Tag 0 marks the retry timer of a peer link, which
+  // is the link's first member; connection ids are never 0.
+  void _run_timers(reactor_t& r) {
+    static_assert(std::is_standard_layout<peer_link_t>::value,
+                  "peer_link_t::retry must be reachable from the link");
+    r.timers.advance(_now_ms(), [this, &r](timer_wheel_t<>::node_t& n) {
+      if (n.tag == 0) {
+        _link_connect(r, *reinterpret_cast<peer_link_t*>(&n));
+        return;
+      }
+      connection_t* pconn = _conns.find((conn_id_t)n.tag);
+      if (pconn == NULL)
+        return;
+      if (pconn->state == STATE_CONNECTING) {
+        const int fd = pconn->fd;
+        _del_conn(r, pconn);
+        static_cast<T*>(this)->connect_failed(fd, ETIMEDOUT);
+      } else {
+        static_cast<T*>(this)->timeout(*pconn);
+      }
+    });
+  }
+
+  static uint64_t _now_usec() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void _link_connect(reactor_t& r, peer_link_t& link) {
+    if (_stop || _draining)
+      return;
+    const peer_t& p = *link.peer;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(p.port);
+    addr.sin_addr.s_addr = inet_addr(p.host.c_str());
+    link.started_usec = _now_usec();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      _link_down(r, link, false);
+      return;
+    }
+    connection_t* pconn = NULL;
+    if (_setnonblocking(fd) == 0
+        && (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+            || errno == EINPROGRESS))
+      pconn = _add_conn(r, fd, STATE_CONNECTING,
+                        EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP);
+    if (pconn == NULL) {
+      close(fd);
+      _link_down(r, link, false);
+      return;
+    }
+    pconn->link = &link;
+    // the peer's timeout replaces the one _add_conn() took from poll_opt_t,
+    // 0 included
+    _set_timer(*pconn, (p.opt.connect_timeout_ms > 0)
+                       ? p.opt.connect_timeout_ms : -1);
+  }
+
+  void _link_up(connection_t& conn) {
+    peer_link_t& link = *conn.link;
+    peer_t& p = *link.peer;
+    const uint64_t usec = _now_usec() - link.started_usec;
+    uint64_t seen = p.connect_usec_max.load(std::memory_order_relaxed);
+    while (usec > seen
+           && !p.connect_usec_max.compare_exchange_weak(seen, usec))
+      ;
+    p.connect_usec.store(usec, std::memory_order_relaxed);
+    p.connects++;
+    link.backoff_ms = p.opt.backoff_min_ms;
+    link.id.store(conn.id, std::memory_order_release);
+  }
+
+  // Waits half the backoff plus a random part of the other half before
+  // the next attempt.
+  void _link_down(reactor_t& r, peer_link_t& link, bool was_up) {
+    peer_t& p = *link.peer;
+    link.id.store(0, std::memory_order_release);
+    if (was_up)
+      p.drops++;
+    else
+      p.failures++;
+    if (_stop || _draining)
+      return;
+    const int backoff = link.backoff_ms;
+    link.backoff_ms = (backoff > p.opt.backoff_max_ms / 2)
+                      ? p.opt.backoff_max_ms : backoff * 2;
+    link.seed = link.seed * 1103515245u + 12345u;
+    const int wait = backoff / 2 + (link.seed >> 8) % (backoff - backoff / 2 + 1);
+    link.retry.tag = 0;
+    r.timers.schedule(link.retry, _now_ms() + wait);
+  }
+
+  void _close_queued(connection_t& conn) {
+    write_req_t req;
+    conn.write_queue.push_back(req);
+    if (!(conn.events & EPOLLOUT))
+      _flush(conn);
+    _update_interest(conn);
+  }
+
+  static bool _queued(const connection_t& conn) {
+#ifdef WORKBIT_IO_URING
+    if (conn.inflight > 0)
+      return true;
+#endif
+    return !conn.write_queue.empty();
+  }
+
+  // Runs between polls while draining; the connections are checked once
+  // per DRAIN_TICK_MS. Returns how long to poll for, or -1 once the
+  // reactor has closed all of its connections; exit_code then says
+  // whether the deadline cut some of them off.
+  enum { DRAIN_TICK_MS = 10 };
+  int _drain_tick(reactor_t& r) {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now < r.drain_check)
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+          r.drain_check - now).count() + 1;
+    r.drain_check = now + std::chrono::milliseconds(DRAIN_TICK_MS);
+    // backwards, as _del_conn() moves the last fd into the freed place
+    bool busy = false;
+    for (size_t i = r.conns.size(); i-- > 0; ) {
+      connection_t& conn = *_conns.find(r.conns[i]);
+      if (conn.state == STATE_LISTEN) {
+        // see _close_reactors(); a successor may own the socket now
+        if (!_handed_off)
+          shutdown(conn.fd, SHUT_RDWR);
+        _del_conn(r, &conn);
+      } else if (conn.state == STATE_CONNECTED && _queued(conn))
+        busy = true;
+    }
+    if (busy && now < _drain_deadline)
+      return DRAIN_TICK_MS;
+    for (size_t i = r.conns.size(); i-- > 0; ) {
+      connection_t& conn = *_conns.find(r.conns[i]);
+      if (conn.state == STATE_CONNECTED) {
+        static_cast<T*>(this)->connection_closed(conn);
+        _del_conn(r, &conn);
+      } else if (conn.state == STATE_CONNECTING) {
+        _del_conn(r, &conn);
+      }
+    }
+    r.exit_code = busy ? 1 : 0;
+    return -1;
+  }
+
+  int _handle_listen(reactor_t& r, connection_t& lconn) {
     int listen_sock = lconn.fd;
     struct sockaddr_in client_addr;
     socklen_t len = sizeof(client_addr);
@@ -267,77 +1985,98 @@ private:
                            &len);
     if (conn_sock < 0)
       return -1;
-    if (_setnonblocking(conn_sock) < 0)
+    return _accepted(r, conn_sock, client_addr);
+  }
+
+  int _accepted(reactor_t& r, int conn_sock, struct sockaddr_in& client_addr) {
+    if (_setnonblocking(conn_sock) < 0) {
+      close(conn_sock);
       return -1;
-    ev.events = EPOLLIN | EPOLLET | EPOLLOUT | EPOLLRDHUP;
-    connection_t* pconn = new connection_t(conn_sock, STATE_CONNECTED);
-    ev.data.ptr = pconn;
-    _conns[conn_sock] = pconn;
-    if (epoll_ctl( _epfd, EPOLL_CTL_ADD, conn_sock, &ev) == -1){
-      delete pconn;
+    }
+    connection_t* pconn = _add_conn(r, conn_sock, STATE_CONNECTED,
+                                    EPOLLIN | EPOLLET | EPOLLRDHUP);
+    if (pconn == NULL) {
+      close(conn_sock);
       return -1;
     }
+    _set_busy_poll(conn_sock);
     pconn->extra = static_cast<T*>(this)->connection_accepted(conn_sock, 
         (struct sockaddr*)&client_addr);
     return 0;
   }
 
-  int _handle_connecting(epoll_event &ev) {
-    int events = ev.events;
-    connection_t* pconn = (connection_t*)ev.data.ptr;
-    int c_fd = pconn->fd;
+  int _handle_connecting(reactor_t& r, connection_t& conn, uint32_t events) {
+    int c_fd = conn.fd;
     if (events & EPOLLERR) {
       int err = 0;
       socklen_t len = sizeof(err);
       int ret = getsockopt(c_fd, SOL_SOCKET, SO_ERROR, &err, &len);
-      epoll_ctl(_epfd, EPOLL_CTL_DEL, c_fd, &ev);
-      close(c_fd);
+      _del_conn(r, &conn);
+      static_cast<T*>(this)->connect_failed(c_fd, err);
       return 0;
     }
     if (events & EPOLLOUT) {
-      pconn->state = STATE_CONNECTED;
-      _conns[c_fd] = pconn;
-      pconn->extra = static_cast<T*>(this)->connection_made(c_fd);
+      _set_busy_poll(c_fd);
+      r.timers.cancel(conn.timer);
+      conn.state = STATE_CONNECTED;
+      conn.extra = static_cast<T*>(this)->connection_made(c_fd);
+      if (conn.link != NULL)
+        _link_up(conn);
+#ifdef WORKBIT_IO_URING
+      conn.events = 0;
+      _arm(r, conn);
+#endif
+      _update_interest(conn);
     }
     return 0;
   }
         
-  int _handle_connected(epoll_event &ev) {
-    connection_t* pconn = (connection_t*)ev.data.ptr;
-    int events = ev.events;
+  int _handle_connected(reactor_t& r, connection_t& conn, uint32_t events) {
+    connection_t* pconn = &conn;
     int c_fd = pconn->fd;
     int flag = 0;
     if (events & EPOLLERR) {
       int err = 0;
       socklen_t len = sizeof(err);
       int ret = getsockopt(c_fd, SOL_SOCKET, SO_ERROR, &err, &len);
-      epoll_ctl( _epfd, EPOLL_CTL_DEL, c_fd, &ev);
-      close(c_fd);
       static_cast<T*>(this)->connection_closed(*pconn);
-      _conns.erase(c_fd);
-      delete pconn;
+      _del_conn(r, pconn);
       return 0;
     }
     if (events & EPOLLOUT) {
+      if (_flush(*pconn) < 0) {
+        static_cast<T*>(this)->connection_closed(*pconn);
+        _del_conn(r, pconn);
+        return 0;
+      }
+      _update_interest(*pconn);
       static_cast<T*>(this)->writable(*pconn);
     }
     if (events & EPOLLIN) {
       static_cast<T*>(this)->readable(*pconn);
     }
-    if (events & EPOLLRDHUP) {
-      static_cast<T*>(this)->connection_closed(*pconn);
+    if (events & (EPOLLRDHUP | EPOLLHUP)) {
+      flag |= CLOSED_RD;
     }
-    if (flag != 0) {
-      _cleanup_connection(pconn, flag);
+    if (flag != 0 || pconn->shutdown_flag != 0) {
+      _cleanup_connection(r, pconn, flag);
     }
+    return 0;
   }
   
-  std::future<int> _future_stop;
-  bool _stop;
-  int _epfd;
-  int _readfd;
-  int _writefd;
-  bitstat_t _stat;
-  std::map<int, connection_t*> _conns;
+  std::atomic<bool> _stop;
+  std::atomic<bool> _draining;
+  std::chrono::steady_clock::time_point _drain_deadline;
+  bool _handed_off;
+  std::mutex _listeners_lock;   // reactors add and remove listeners
+  std::vector<int> _listeners;
+  std::atomic<unsigned> _next_reactor;
+  poll_opt_t _poll_opt;
+  size_t _high_watermark;
+  size_t _low_watermark;
+  std::vector<reactor_t*> _reactors;
+  bitstat_t _closed_stat;     // what the reactors of the last run counted
+  std::vector<peer_t*> _peers;
+  fdtable_t<connection_t> _conns;
 };
 
@@ -0,0 +1,172 @@
+/*
+ * Per-entry publishing against claiming and committing runs of entries
+ * with publisher_next_n_entries_blocking()/publisher_commit_range_blocking(),
+ * on a multi-producer and on a single-producer ring, and the single-producer
+ * ring under each wait strategy.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "ringbuf.h"
+
+#define STOP UINT_FAST64_MAX
+#define ENTRIES_TO_GENERATE (20 * 1000 * 1000)
+#define ENTRY_BUFFER_SIZE (1024*4) // must be a power of two
+#define MAX_ENTRY_PROCESSORS (8)
+
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS> u64_ring_buffer_t;
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS, 64, 4096,
+        single_producer> u64_sp_ring_buffer_t;
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS, 64, 4096,
+        single_producer, spin_wait_t> u64_spin_ring_buffer_t;
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS, 64, 4096,
+        single_producer, yield_wait_t<> > u64_yield_ring_buffer_t;
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS, 64, 4096,
+        single_producer, futex_wait_t<> > u64_futex_ring_buffer_t;
+
+template<class R>
+struct processor_arg_t {
+    R* buffer;
+    uint_fast64_t first;
+    typename R::count_t reg_number;
+    uint_fast64_t errors;
+    struct timeval end;
+};
+
+template<class R>
+static void*
+entry_processor_thread(void *arg)
+{
+    processor_arg_t<R>* p = (processor_arg_t<R>*) arg;
+    typename R::cursor_t n;
+    typename R::cursor_t cursor;
+    typename R::cursor_t cursor_upper_limit;
+
+    cursor.sequence = p->first;
+    cursor_upper_limit.sequence = cursor.sequence;
+    do
+    {
+        p->buffer->processor_barrier_wait_blocking(cursor_upper_limit);
+        for (n.sequence = cursor.sequence;
+                n.sequence <= cursor_upper_limit.sequence; ++n.sequence)
+        {
+            const typename R::entry_t& entry = p->buffer->show_entry(n);
+            if (STOP == entry.content)
+                goto out;
+            if (n.sequence != entry.content)
+                p->errors++;
+        }
+        p->buffer->processor_barrier_release_entry(p->reg_number, cursor_upper_limit);
+
+        ++cursor_upper_limit.sequence;
+        cursor.sequence = cursor_upper_limit.sequence;
+    } while (1);
+out:
+    gettimeofday(&p->end, NULL);
+    p->buffer->processor_barrier_unregister(p->reg_number);
+    return NULL;
+}
+
+template<class R>
+static void publish_stop(R& buffer)
+{
+    typename R::cursor_t cursor;
+
+    buffer.publisher_next_entry_blocking(cursor);
+    buffer.processor_acquire_entry(cursor).content = STOP;
+    buffer.publisher_commit_entry_blocking(cursor);
+}
+
+template<class R>
+static void publish_single(R& buffer, uint_fast64_t reps)
+{
+    typename R::cursor_t cursor;
+
+    do {
+        buffer.publisher_next_entry_blocking(cursor);
+        buffer.processor_acquire_entry(cursor).content = cursor.sequence;
+        buffer.publisher_commit_entry_blocking(cursor);
+    } while (--reps);
+}
+
+template<class R>
+static void publish_batched(R& buffer, uint_fast64_t reps, unsigned int batch)
+{
+    typename R::cursor_t lo;
+    typename R::cursor_t hi;
+    typename R::cursor_t at;
+
+    while (reps > 0) {
+        unsigned int n = (reps < batch) ? reps : batch;
+        buffer.publisher_next_n_entries_blocking(lo, n);
+        hi.sequence = lo.sequence + n - 1;
+        at.sequence = lo.sequence;
+        while (at.sequence <= hi.sequence) {
+            unsigned int span = hi.sequence - at.sequence + 1;
+            typename R::entry_t* entries = buffer.entry_span(at, span);
+            for (unsigned int i = 0; i < span; ++i)
+                entries[i].content = at.sequence + i;
+            at.sequence += span;
+        }
+        buffer.publisher_commit_range_blocking(lo, hi);
+        reps -= n;
+    }
+}
+
+// batch 0 runs the per-entry path
+template<class R>
+static void run(const char* mode, unsigned int batch)
+{
+    R buffer(ENTRY_BUFFER_SIZE);
+    processor_arg_t<R> arg;
+    pthread_t thread_id;
+    struct timeval start;
+
+    arg.buffer = &buffer;
+    arg.errors = 0;
+    arg.first = buffer.processor_barrier_register(arg.reg_number);
+    if (pthread_create(&thread_id, NULL, entry_processor_thread<R>, &arg)) {
+        printf("could not create entry processor thread\n");
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+    if (batch == 0)
+        publish_single(buffer, ENTRIES_TO_GENERATE);
+    else
+        publish_batched(buffer, ENTRIES_TO_GENERATE, batch);
+    publish_stop(buffer);
+    pthread_join(thread_id, NULL);
+
+    double elapsed = (arg.end.tv_sec - start.tv_sec)
+            + (arg.end.tv_usec - start.tv_usec) / 1000000.0;
+    if (batch == 0)
+        printf("%s per entry : ", mode);
+    else
+        printf("%s batch %4u: ", mode, batch);
+    printf("%lf s, %.0lf entries/s, errors %lu\n", elapsed,
+            (double) ENTRIES_TO_GENERATE / elapsed, (unsigned long) arg.errors);
+}
+
+int main(int argc, char *argv[])
+{
+    run<u64_ring_buffer_t>("mp", 0);
+    for (unsigned int batch = 1; batch <= 256; batch *= 2)
+        run<u64_ring_buffer_t>("mp", batch);
+    run<u64_sp_ring_buffer_t>("sp", 0);
+    for (unsigned int batch = 1; batch <= 256; batch *= 2)
+        run<u64_sp_ring_buffer_t>("sp", batch);
+    // a spinning processor starves the publisher when they share a core
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        run<u64_spin_ring_buffer_t>("sp spin ", 0);
+        run<u64_spin_ring_buffer_t>("sp spin ", 64);
+    }
+    run<u64_yield_ring_buffer_t>("sp yield", 0);
+    run<u64_yield_ring_buffer_t>("sp yield", 64);
+    run<u64_futex_ring_buffer_t>("sp futex", 0);
+    run<u64_futex_ring_buffer_t>("sp futex", 64);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "workbit.h"
+#include "opstage.h"
+
+using namespace std;
+
+// Frames are fixed size here so the benchmark measures the hand-off, not
+// the framing. With no processors they are consumed on the reactor.
+class benchnode : public workbit<benchnode>, public opstage_t<benchnode> {
+public:
+  benchnode(size_t frame_size, int work): _frame_size(frame_size),
+    _work(work), _frames(0) {}
+
+  void* connection_accepted(int fd, struct sockaddr* addr) {
+    return new vector<uint8_t>();
+  }
+  void* connection_made(int fd) {
+    return new vector<uint8_t>();
+  }
+  void connection_closed(const connection_t& conn) {
+    delete (vector<uint8_t>*)conn.extra;
+  }
+
+  int data(const connection_t& conn, size_t len, void* data) {
+    vector<uint8_t>& partial = *(vector<uint8_t>*)conn.extra;
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    if (!partial.empty()) {
+      size_t n = min((size_t)(end - p), _frame_size - partial.size());
+      partial.insert(partial.end(), p, p + n);
+      p += n;
+      if (partial.size() < _frame_size)
+        return 0;
+      _frame(conn, &partial[0]);
+      partial.clear();
+    }
+    for (; (size_t)(end - p) >= _frame_size; p += _frame_size)
+      _frame(conn, p);
+    partial.assign(p, end);
+    return 0;
+  }
+
+  void process_frame(const frame_t& f) {
+    _operator(f.data, f.len);
+  }
+
+  uint64_t frames() const {
+    return _frames.load(memory_order_relaxed);
+  }
+
+private:
+  void _frame(const connection_t& conn, const uint8_t* data) {
+    if (stage_running())
+      publish_frame(conn.id, conn.fd, data, _frame_size);
+    else
+      _operator(data, _frame_size);
+  }
+
+  // stands in for a heavy operator: _work passes over the frame
+  void _operator(const uint8_t* data, size_t len) {
+    uint64_t sum = 0;
+    for (int w = 0; w < _work; w++) {
+      for (size_t i = 0; i < len; i++)
+        sum += data[i];
+    }
+    _sink += sum;
+    _frames.fetch_add(1, memory_order_relaxed);
+  }
+
+  size_t _frame_size;
+  int _work;
+  atomic<uint64_t> _frames;
+  volatile uint64_t _sink;
+};
+
+static void client(int port, size_t frame_size, uint64_t frames) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    return;
+  }
+  size_t batch = max((size_t)1, (size_t)(256 << 10) / frame_size);
+  vector<uint8_t> buf(batch * frame_size, 0x5a);
+  while (frames > 0) {
+    uint64_t n = min((uint64_t)batch, frames);
+    size_t len = n * frame_size;
+    for (size_t off = 0; off < len; ) {
+      ssize_t w = write(s, &buf[off], len - off);
+      if (w <= 0)
+        return;
+      off += w;
+    }
+    frames -= n;
+  }
+  close(s);
+}
+
+// bench_stage [frames] [frame_size] [processors] [clients] [work]
+int main(int argc, char** argv) {
+  uint64_t frames = (argc > 1) ? atoll(argv[1]) : 2000000;
+  size_t frame_size = (argc > 2) ? atoi(argv[2]) : 64;
+  int processors = (argc > 3) ? atoi(argv[3]) : 2;
+  int clients = (argc > 4) ? atoi(argv[4]) : 2;
+  int work = (argc > 5) ? atoi(argv[5]) : 1;
+  const int port = 9611;
+
+  benchnode node(frame_size, work);
+  if (processors > 0 && !node.start_stage(processors, 1 << 22)) {
+    cout << "cannot start " << processors << " processors\n";
+    return 1;
+  }
+  node.start(1);
+  if (node.prepare_listen("0.0.0.0", port) < 0) {
+    cout << "cannot listen on " << port << "\n";
+    return 1;
+  }
+
+  uint64_t total = frames / clients * clients;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  vector<thread> senders;
+  for (int i = 0; i < clients; i++)
+    senders.push_back(thread(client, port, frame_size, total / clients));
+  for (size_t i = 0; i < senders.size(); i++)
+    senders[i].join();
+  while (node.frames() < total)
+    this_thread::sleep_for(chrono::microseconds(100));
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - t0)
+                .count();
+
+  cout << "frames: " << total << ", frame size: " << frame_size
+       << ", processors: " << processors << ", clients: " << clients
+       << ", work: " << work << "\n"
+       << "  " << secs << " s, " << (uint64_t)(total / secs)
+       << " frames/s, " << (total * frame_size / secs / (1 << 20))
+       << " MB/s\n";
+  node.stop();
+  node.stop_stage();
+  return 0;
+}
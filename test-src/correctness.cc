@@ -14,8 +14,10 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sys/wait.h>
 
-#include "disrupp.h"
+#include "ringbuf.h"
+#include "bytering.h"
 
 #define STOP UINT64_MAX
 #define ENTRIES_TO_GENERATE (30)
@@ -165,6 +167,447 @@ entry_processor_thread(void *arg)
     return NULL;
 }
 
+//
+// diamond: a journaler and a replicator stamp every entry, and the business
+// logic processor, which depends on both, must only ever see stamped entries
+//
+#define DIAMOND_ENTRIES (100000)
+
+struct stamped_t {
+    uint_fast64_t value;
+    uint_fast64_t journaled;
+    uint_fast64_t replicated;
+};
+typedef ring_buffer_t<stamped_t, 4> stamped_ring_buffer_t;
+
+struct stage_arg_t {
+    stamped_ring_buffer_t *buffer;
+    stamped_ring_buffer_t::count_t reg_number;
+    uint_fast64_t first;
+    stamped_ring_buffer_t::count_t deps[2];
+    unsigned int ndeps;
+    int stage; // 0: journaler, 1: replicator, 2: business logic
+    uint_fast64_t errors;
+};
+
+static void*
+diamond_stage_thread(void *arg)
+{
+    stage_arg_t *p = (stage_arg_t*) arg;
+    stamped_ring_buffer_t::cursor_t n;
+    stamped_ring_buffer_t::cursor_t cursor;
+    stamped_ring_buffer_t::cursor_t cursor_upper_limit;
+
+    cursor.sequence = p->first;
+    cursor_upper_limit.sequence = cursor.sequence;
+    do
+    {
+        p->buffer->processor_barrier_wait_blocking(cursor_upper_limit, p->deps, p->ndeps);
+        for (n.sequence = cursor.sequence;
+                n.sequence <= cursor_upper_limit.sequence; ++n.sequence)
+        {
+            stamped_t& entry = p->buffer->processor_acquire_entry(n).content;
+            if (p->stage == 0)
+                entry.journaled = entry.value;
+            else if (p->stage == 1)
+                entry.replicated = entry.value;
+            else if (entry.journaled != entry.value || entry.replicated != entry.value)
+                p->errors++;
+            if (STOP == entry.value)
+                goto out;
+        }
+        p->buffer->processor_barrier_release_entry(p->reg_number, cursor_upper_limit);
+
+        ++cursor_upper_limit.sequence;
+        cursor.sequence = cursor_upper_limit.sequence;
+    } while (1);
+out:
+    p->buffer->processor_barrier_unregister(p->reg_number);
+    return NULL;
+}
+
+static int diamond_test()
+{
+    stamped_ring_buffer_t buffer(ENTRY_BUFFER_SIZE);
+    stamped_ring_buffer_t::cursor_t cursor;
+    stage_arg_t args[3];
+    pthread_t threads[3];
+
+    for (int i = 0; i < 3; ++i) {
+        args[i].buffer = &buffer;
+        args[i].first = buffer.processor_barrier_register(args[i].reg_number);
+        args[i].ndeps = 0;
+        args[i].stage = i;
+        args[i].errors = 0;
+    }
+    args[2].deps[0] = args[0].reg_number;
+    args[2].deps[1] = args[1].reg_number;
+    args[2].ndeps = 2;
+    for (int i = 0; i < 3; ++i)
+        create_thread(&threads[i], &args[i], diamond_stage_thread);
+
+    for (uint_fast64_t v = 1; v <= DIAMOND_ENTRIES + 1; ++v) {
+        buffer.publisher_next_entry_blocking(cursor);
+        stamped_t& entry = buffer.processor_acquire_entry(cursor).content;
+        entry.value = (v > DIAMOND_ENTRIES) ? STOP : v;
+        entry.journaled = entry.replicated = 0;
+        buffer.publisher_commit_entry_blocking(cursor);
+    }
+    for (int i = 0; i < 3; ++i)
+        pthread_join(threads[i], NULL);
+
+    if (args[2].errors) {
+        printf("Diamond - ERROR (%lu unstamped entries)\n", (unsigned long) args[2].errors);
+        return 0;
+    }
+    printf("Diamond test done\n");
+    return 1;
+}
+
+//
+// work queue: every entry must reach exactly one of the workers
+//
+#define WORK_ENTRIES (100000)
+#define WORKERS (3)
+
+typedef ring_buffer_t<uint_fast64_t, WORKERS> work_ring_buffer_t;
+
+static uint8_t work_seen[WORK_ENTRIES + 1];
+
+struct worker_arg_t {
+    work_ring_buffer_t *buffer;
+    work_ring_buffer_t::count_t reg_number;
+    uint_fast64_t processed;
+};
+
+static void*
+worker_thread(void *arg)
+{
+    worker_arg_t *p = (worker_arg_t*) arg;
+    work_ring_buffer_t::cursor_t cursor;
+
+    do
+    {
+        p->buffer->worker_claim_entry_blocking(p->reg_number, cursor);
+        const uint_fast64_t value = p->buffer->show_entry(cursor).content;
+        if (STOP == value)
+            break;
+        __atomic_fetch_add(&work_seen[value], 1, __ATOMIC_RELAXED);
+        p->processed++;
+    } while (1);
+    p->buffer->processor_barrier_unregister(p->reg_number);
+    return NULL;
+}
+
+static int work_queue_test()
+{
+    work_ring_buffer_t buffer(ENTRY_BUFFER_SIZE);
+    work_ring_buffer_t::cursor_t cursor;
+    worker_arg_t args[WORKERS];
+    pthread_t threads[WORKERS];
+    uint_fast64_t processed = 0;
+
+    for (int i = 0; i < WORKERS; ++i) {
+        args[i].buffer = &buffer;
+        args[i].processed = 0;
+        buffer.worker_barrier_register(args[i].reg_number);
+    }
+    for (int i = 0; i < WORKERS; ++i)
+        create_thread(&threads[i], &args[i], worker_thread);
+
+    // one STOP per worker, as each entry only reaches one of them
+    for (uint_fast64_t v = 1; v <= WORK_ENTRIES + WORKERS; ++v) {
+        buffer.publisher_next_entry_blocking(cursor);
+        buffer.processor_acquire_entry(cursor).content = (v > WORK_ENTRIES) ? STOP : v;
+        buffer.publisher_commit_entry_blocking(cursor);
+    }
+    for (int i = 0; i < WORKERS; ++i) {
+        pthread_join(threads[i], NULL);
+        processed += args[i].processed;
+    }
+
+    for (uint_fast64_t v = 1; v <= WORK_ENTRIES; ++v) {
+        if (work_seen[v] != 1) {
+            printf("Work queue - ERROR (entry %lu seen %d times)\n", (unsigned long) v, work_seen[v]);
+            return 0;
+        }
+    }
+    printf("Work queue test done (%lu/%lu/%lu per worker)\n", (unsigned long) args[0].processed,
+            (unsigned long) args[1].processed, (unsigned long) args[2].processed);
+    return processed == WORK_ENTRIES;
+}
+
+//
+// shared memory: a processor in another process, then one that crashes
+//
+#define SHARED_ENTRIES (100000)
+
+typedef ring_buffer_t<uint_fast64_t, MAX_ENTRY_PROCESSORS, 64, 4096,
+        single_producer, yield_wait_t<> > shared_ring_buffer_t;
+
+// runs in the child: attaches, registers, tells the parent, then consumes
+// until STOP unless it is meant to crash
+static int shared_child(shared_ring_buffer_t *buffer, int ready, bool crash)
+{
+    shared_ring_buffer_t::count_t reg_number;
+    shared_ring_buffer_t::cursor_t n;
+    shared_ring_buffer_t::cursor_t upper;
+    uint_fast64_t expected = 1;
+
+    if (!buffer)
+        return 1;
+    upper.sequence = buffer->processor_barrier_register(reg_number);
+    if (write(ready, "r", 1) != 1 || crash)
+        return 0;
+    do
+    {
+        n.sequence = upper.sequence;
+        buffer->processor_barrier_wait_blocking(upper);
+        for (; n.sequence <= upper.sequence; ++n.sequence) {
+            const uint_fast64_t value = buffer->show_entry(n).content;
+            if (STOP == value)
+                return expected != SHARED_ENTRIES + 1;
+            if (value != expected++)
+                return 1;
+        }
+        buffer->processor_barrier_release_entry(reg_number, upper);
+        ++upper.sequence;
+    } while (1);
+}
+
+static int shared_run(shared_ring_buffer_t *buffer, const char *name, bool crash)
+{
+    shared_ring_buffer_t::cursor_t cursor;
+    int ready[2];
+    int status;
+    char c;
+
+    if (pipe(ready) < 0)
+        return 0;
+    const pid_t child = fork();
+    if (child == 0) {
+        shared_ring_buffer_t *attached = name ? shared_ring_buffer_t::shm_attach(name)
+                : shared_ring_buffer_t::shm_attach_fd(buffer->shm_fd());
+        _exit(shared_child(attached, ready[1], crash));
+    }
+    close(ready[1]);
+    if (child < 0 || read(ready[0], &c, 1) != 1) {
+        close(ready[0]);
+        return 0;
+    }
+    close(ready[0]);
+    // a crashed processor is only reaped once it has been waited for
+    if (crash && waitpid(child, &status, 0) != child)
+        return 0;
+
+    for (uint_fast64_t v = 1; v <= SHARED_ENTRIES + 1; ++v) {
+        buffer->publisher_next_entry_blocking(cursor);
+        buffer->processor_acquire_entry(cursor).content = (v > SHARED_ENTRIES) ? STOP : v;
+        buffer->publisher_commit_entry_blocking(cursor);
+    }
+    if (crash)
+        return 1;
+    return waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int shared_memory_test()
+{
+    char name[64];
+    shared_ring_buffer_t *named;
+    shared_ring_buffer_t *anonymous;
+
+    snprintf(name, sizeof(name), "/opgrid-correctness-%d", (int) getpid());
+    named = shared_ring_buffer_t::shm_create(name, ENTRY_BUFFER_SIZE);
+    if (!named || !shared_run(named, name, false)) {
+        printf("Shared memory - ERROR (named segment)\n");
+        delete named;
+        return 0;
+    }
+    delete named;
+
+    anonymous = shared_ring_buffer_t::shm_create(NULL, ENTRY_BUFFER_SIZE, true);
+    if (!anonymous || !shared_run(anonymous, NULL, true)) {
+        printf("Shared memory - ERROR (crashed processor)\n");
+        delete anonymous;
+        return 0;
+    }
+    delete anonymous;
+    printf("Shared memory test done\n");
+    return 1;
+}
+
+//
+// registry: registration fails when the ring is full, and a late joiner
+// starts right after what is already published
+//
+static int registry_test()
+{
+    u64_ring_buffer_t buffer(ENTRY_BUFFER_SIZE);
+    u64_ring_buffer_t::count_t reg_number[MAX_ENTRY_PROCESSORS + 1];
+    u64_ring_buffer_t::cursor_t cursor;
+    uint_fast64_t first;
+
+    for (int i = 0; i < MAX_ENTRY_PROCESSORS; ++i) {
+        if (!buffer.processor_barrier_try_register(reg_number[i], first) || first != 1) {
+            printf("Registry - ERROR (register %d)\n", i);
+            return 0;
+        }
+    }
+    if (buffer.processor_barrier_try_register(reg_number[MAX_ENTRY_PROCESSORS], first)) {
+        printf("Registry - ERROR (registered past capacity)\n");
+        return 0;
+    }
+
+    for (int i = 0; i < 5; ++i) {
+        buffer.publisher_next_entry_blocking(cursor);
+        buffer.processor_acquire_entry(cursor).content = cursor.sequence;
+        buffer.publisher_commit_entry_blocking(cursor);
+    }
+    buffer.processor_barrier_release_entry(reg_number[0], cursor);
+    buffer.processor_barrier_release_entry(reg_number[1], cursor);
+    buffer.processor_barrier_unregister(reg_number[1]);
+    if (!buffer.processor_barrier_try_register(reg_number[1], first) || first != 6) {
+        printf("Registry - ERROR (late joiner starts at %lu)\n", (unsigned long) first);
+        return 0;
+    }
+    buffer.processor_barrier_unregister(reg_number[0]);
+    buffer.processor_barrier_unregister(reg_number[1]);
+    // nothing claimed the published entries, and nothing protected them
+    first = buffer.worker_barrier_register(reg_number[0]);
+    if (first != 6) {
+        printf("Registry - ERROR (late worker starts at %lu)\n", (unsigned long) first);
+        return 0;
+    }
+    buffer.processor_barrier_unregister(reg_number[0]);
+    printf("Registry test done\n");
+    return 1;
+}
+
+//
+// byte ring: variable-length records from several publishers, wrapping
+// many times around a small buffer
+//
+#define BYTE_RECORDS (20000)
+#define BYTE_PUBLISHERS (3)
+#define BYTE_PROCESSORS (2)
+
+typedef byte_ring_t<BYTE_PROCESSORS> test_byte_ring_t;
+
+struct byte_record_t {
+    uint32_t publisher;     // BYTE_PUBLISHERS stops the processors
+    uint32_t sequence;
+};
+
+struct byte_arg_t {
+    test_byte_ring_t *ring;
+    test_byte_ring_t::count_t reg_number;
+    uint_fast64_t first;
+    uint32_t publisher;
+    uint_fast64_t errors;
+};
+
+static uint32_t byte_record_len(uint32_t publisher, uint32_t sequence)
+{
+    return sizeof(byte_record_t) + (publisher * 131 + sequence * 17) % 300;
+}
+
+static void*
+byte_publisher_thread(void *arg)
+{
+    byte_arg_t *p = (byte_arg_t*) arg;
+    test_byte_ring_t::claim_t claim;
+
+    for (uint32_t sequence = 0; sequence < BYTE_RECORDS; ++sequence) {
+        const uint32_t len = byte_record_len(p->publisher, sequence);
+        uint8_t *data = p->ring->publisher_claim_blocking(claim, len);
+        byte_record_t *r = (byte_record_t*) data;
+
+        r->publisher = p->publisher;
+        r->sequence = sequence;
+        memset(data + sizeof(byte_record_t), (uint8_t) sequence, len - sizeof(byte_record_t));
+        p->ring->publisher_commit_blocking(claim);
+    }
+    return NULL;
+}
+
+static void*
+byte_processor_thread(void *arg)
+{
+    byte_arg_t *p = (byte_arg_t*) arg;
+    uint32_t next[BYTE_PUBLISHERS] = { 0 };
+    uint_fast64_t offset = p->first;
+
+    do
+    {
+        const uint_fast64_t end = p->ring->processor_wait_blocking(offset);
+        while (offset != end) {
+            const test_byte_ring_t::record_t *record = p->ring->processor_next_record(offset);
+            const byte_record_t *r = (const byte_record_t*) record->data;
+
+            if (r->publisher == BYTE_PUBLISHERS)
+                goto out;
+            if (r->sequence != next[r->publisher]++
+                    || record->len != byte_record_len(r->publisher, r->sequence))
+                p->errors++;
+            for (uint32_t n = sizeof(byte_record_t); n < record->len; ++n)
+                if (record->data[n] != (uint8_t) r->sequence)
+                    p->errors++;
+        }
+        p->ring->processor_release(p->reg_number, offset);
+    } while (1);
+out:
+    for (int n = 0; n < BYTE_PUBLISHERS; ++n)
+        if (next[n] != BYTE_RECORDS)
+            p->errors++;
+    p->ring->processor_unregister(p->reg_number);
+    return NULL;
+}
+
+static int byte_ring_test()
+{
+    test_byte_ring_t ring(4096);
+    test_byte_ring_t::claim_t claim;
+    byte_arg_t publishers[BYTE_PUBLISHERS];
+    byte_arg_t processors[BYTE_PROCESSORS];
+    pthread_t threads[BYTE_PUBLISHERS + BYTE_PROCESSORS];
+    uint_fast64_t errors = 0;
+
+    for (int i = 0; i < BYTE_PROCESSORS; ++i) {
+        processors[i].ring = &ring;
+        processors[i].errors = 0;
+        processors[i].first = ring.processor_register(processors[i].reg_number);
+        create_thread(&threads[i], &processors[i], byte_processor_thread);
+    }
+    test_byte_ring_t::count_t extra;
+    uint_fast64_t first;
+    if (ring.processor_try_register(extra, first)) {
+        printf("Byte ring - ERROR (registered past capacity)\n");
+        return 0;
+    }
+    for (int i = 0; i < BYTE_PUBLISHERS; ++i) {
+        publishers[i].ring = &ring;
+        publishers[i].publisher = i;
+        create_thread(&threads[BYTE_PROCESSORS + i], &publishers[i], byte_publisher_thread);
+    }
+    for (int i = 0; i < BYTE_PUBLISHERS; ++i)
+        pthread_join(threads[BYTE_PROCESSORS + i], NULL);
+
+    byte_record_t *stop = (byte_record_t*) ring.publisher_claim_blocking(claim, sizeof(byte_record_t));
+    stop->publisher = BYTE_PUBLISHERS;
+    ring.publisher_commit_blocking(claim);
+    for (int i = 0; i < BYTE_PROCESSORS; ++i) {
+        pthread_join(threads[i], NULL);
+        errors += processors[i].errors;
+    }
+
+    if (errors || ring.publisher_claim_blocking(claim, ring.max_record() + 1)) {
+        printf("Byte ring - ERROR (%lu errors)\n", (unsigned long) errors);
+        return 0;
+    }
+    printf("Byte ring test done\n");
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -245,8 +688,19 @@ int main(int argc, char *argv[])
     // join entry processors
     pthread_join(c_1, NULL);
     pthread_join(c_2, NULL);
-    free(ring_buffer_heap);
-    printf("On-The-Heap (blocking) test done\n");
+    delete ring_buffer_heap;
+    printf("On-The-Heap (blocking) test done\n\n");
+
+    if (!diamond_test())
+        return EXIT_FAILURE;
+    if (!work_queue_test())
+        return EXIT_FAILURE;
+    if (!shared_memory_test())
+        return EXIT_FAILURE;
+    if (!byte_ring_test())
+        return EXIT_FAILURE;
+    if (!registry_test())
+        return EXIT_FAILURE;
 
     return EXIT_SUCCESS;
 }
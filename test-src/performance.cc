@@ -12,10 +12,14 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <pthread.h>
 
-#include "disrupp.h"
+#include "ringbuf.h"
 
 #define STOP UINT_FAST64_MAX
 #define ENTRIES_TO_GENERATE (50 * 1000 * 1000 * 5)
@@ -49,17 +53,25 @@ static int create_thread(pthread_t * const thread_id, void *thread_arg,
     return retv;
 }
 
+// Processors are registered before the publisher starts, so none of them
+// joins late and misses the first entries.
+struct processor_arg_t {
+    u64_ring_buffer_t *buffer;
+    u64_ring_buffer_t::count_t reg_number;
+    uint_fast64_t first;
+};
+
 static void*
 entry_processor_thread(void *arg)
 {
+    processor_arg_t *p = (processor_arg_t*) arg;
     u64_ring_buffer_t::cursor_t n;
-    u64_ring_buffer_t *buffer = (u64_ring_buffer_t*) arg;
+    u64_ring_buffer_t *buffer = p->buffer;
     u64_ring_buffer_t::cursor_t cursor;
     u64_ring_buffer_t::cursor_t cursor_upper_limit;
-    u64_ring_buffer_t::count_t reg_number;
+    u64_ring_buffer_t::count_t& reg_number = p->reg_number;
 
-    // register and setup entry processor
-    cursor.sequence = buffer->processor_barrier_register(reg_number);
+    cursor.sequence = p->first;
     cursor_upper_limit.sequence = cursor.sequence;
     int err_count = 0;
     int total_record = 0;
@@ -90,12 +102,232 @@ out:
     return NULL;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////
+//          publish cost against the number of entry processors (performance sweep)
+////////////////////////////////////////////////////////////////////////////////////////
+
+#define SWEEP_ENTRIES (4 * 1000 * 1000)
+#define SWEEP_MAX_PROCESSORS (64)
+
+typedef ring_buffer_t<uint_fast64_t, SWEEP_MAX_PROCESSORS> sweep_ring_buffer_t;
+
+struct sweep_arg_t {
+    sweep_ring_buffer_t *buffer;
+    sweep_ring_buffer_t::count_t reg_number;
+    uint_fast64_t first;
+};
+
+static void*
+sweep_processor_thread(void *arg)
+{
+    sweep_arg_t *p = (sweep_arg_t*) arg;
+    sweep_ring_buffer_t::cursor_t n;
+    sweep_ring_buffer_t::cursor_t cursor;
+    sweep_ring_buffer_t::cursor_t cursor_upper_limit;
+
+    cursor.sequence = p->first;
+    cursor_upper_limit.sequence = cursor.sequence;
+    do
+    {
+        p->buffer->processor_barrier_wait_blocking(cursor_upper_limit);
+        for (n.sequence = cursor.sequence;
+                n.sequence <= cursor_upper_limit.sequence; ++n.sequence)
+        {
+            if (STOP == p->buffer->show_entry(n).content)
+                goto out;
+        }
+        p->buffer->processor_barrier_release_entry(p->reg_number, cursor_upper_limit);
+
+        ++cursor_upper_limit.sequence;
+        cursor.sequence = cursor_upper_limit.sequence;
+    } while (1);
+out:
+    p->buffer->processor_barrier_unregister(p->reg_number);
+    return NULL;
+}
+
+static void consumer_sweep()
+{
+    for (int processors = 1; processors <= SWEEP_MAX_PROCESSORS; processors *= 2) {
+        sweep_ring_buffer_t buffer(ENTRY_BUFFER_SIZE);
+        sweep_ring_buffer_t::cursor_t cursor;
+        pthread_t thread_id[SWEEP_MAX_PROCESSORS];
+        sweep_arg_t args[SWEEP_MAX_PROCESSORS];
+        struct timeval sweep_start;
+        struct timeval sweep_end;
+
+        for (int i = 0; i < processors; ++i) {
+            args[i].buffer = &buffer;
+            args[i].first = buffer.processor_barrier_register(args[i].reg_number);
+            if (!create_thread(&thread_id[i], &args[i], sweep_processor_thread)) {
+                printf("could not create entry processor thread\n");
+                return;
+            }
+        }
+
+        gettimeofday(&sweep_start, NULL);
+        for (uint_fast64_t reps = SWEEP_ENTRIES; reps > 0; --reps) {
+            buffer.publisher_next_entry_blocking(cursor);
+            buffer.processor_acquire_entry(cursor).content = cursor.sequence;
+            buffer.publisher_commit_entry_blocking(cursor);
+        }
+        gettimeofday(&sweep_end, NULL);
+
+        buffer.publisher_next_entry_blocking(cursor);
+        buffer.processor_acquire_entry(cursor).content = STOP;
+        buffer.publisher_commit_entry_blocking(cursor);
+        for (int i = 0; i < processors; ++i)
+            pthread_join(thread_id[i], NULL);
+
+        double elapsed = (sweep_end.tv_sec - sweep_start.tv_sec)
+                + (sweep_end.tv_usec - sweep_start.tv_usec) / 1000000.0;
+        printf("%2d entry processors: %.1lf ns per publish\n", processors,
+                elapsed * 1e9 / SWEEP_ENTRIES);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+//          padded against dense entries, consumed in batches (performance layout)
+////////////////////////////////////////////////////////////////////////////////////////
+
+#define LAYOUT_ENTRIES (50 * 1000 * 1000)
+
+typedef ring_buffer_t<uint_fast64_t, 1, 64, 4096, single_producer, yield_wait_t<>,
+        padded_entries> padded_ring_buffer_t;
+typedef ring_buffer_t<uint_fast64_t, 1, 64, 4096, single_producer, yield_wait_t<>,
+        dense_entries> dense_ring_buffer_t;
+
+template<class R>
+struct layout_arg_t {
+    R *buffer;
+    typename R::count_t reg_number;
+    uint_fast64_t first;
+    uint_fast64_t sum;
+};
+
+template<class R>
+static void*
+layout_processor_thread(void *arg)
+{
+    layout_arg_t<R> *p = (layout_arg_t<R>*) arg;
+    typename R::cursor_t n;
+    typename R::cursor_t cursor;
+    typename R::cursor_t cursor_upper_limit;
+
+    cursor.sequence = p->first;
+    cursor_upper_limit.sequence = cursor.sequence;
+    do
+    {
+        p->buffer->processor_barrier_wait_blocking(cursor_upper_limit);
+        for (n.sequence = cursor.sequence;
+                n.sequence <= cursor_upper_limit.sequence; ++n.sequence)
+        {
+            const uint_fast64_t value = p->buffer->show_entry(n).content;
+            if (STOP == value)
+                goto out;
+            p->sum += value;
+        }
+        p->buffer->processor_barrier_release_entry(p->reg_number, cursor_upper_limit);
+
+        ++cursor_upper_limit.sequence;
+        cursor.sequence = cursor_upper_limit.sequence;
+    } while (1);
+out:
+    p->buffer->processor_barrier_unregister(p->reg_number);
+    return NULL;
+}
+
+// Counts cache misses of this process and the threads it starts from now
+// on; -1 where perf events are not available.
+static int open_cache_misses()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+template<class R>
+static void layout_run(const char *name)
+{
+    R buffer(ENTRY_BUFFER_SIZE);
+    typename R::cursor_t lo;
+    typename R::cursor_t hi;
+    layout_arg_t<R> arg;
+    pthread_t thread_id;
+    struct timeval layout_start;
+    struct timeval layout_end;
+    uint64_t misses = 0;
+    const int perf = open_cache_misses();
+
+    arg.buffer = &buffer;
+    arg.sum = 0;
+    arg.first = buffer.processor_barrier_register(arg.reg_number);
+    gettimeofday(&layout_start, NULL);
+    if (!create_thread(&thread_id, &arg, layout_processor_thread<R>)) {
+        printf("could not create entry processor thread\n");
+        return;
+    }
+
+    for (uint_fast64_t v = 0; v <= LAYOUT_ENTRIES; v += 64) {
+        buffer.publisher_next_n_entries_blocking(lo, 64);
+        hi.sequence = lo.sequence + 63;
+        unsigned int span = 64;
+        typename R::entry_t *entries = buffer.entry_span(lo, span);
+        for (unsigned int i = 0; i < span; ++i)
+            entries[i].content = (v + i < LAYOUT_ENTRIES) ? v + i : STOP;
+        if (span < 64) {
+            typename R::cursor_t at = { lo.sequence + span, {0} };
+            unsigned int rest = 64 - span;
+            entries = buffer.entry_span(at, rest);
+            for (unsigned int i = 0; i < rest; ++i)
+                entries[i].content = (v + span + i < LAYOUT_ENTRIES) ? v + span + i : STOP;
+        }
+        buffer.publisher_commit_range_blocking(lo, hi);
+    }
+    pthread_join(thread_id, NULL);
+    gettimeofday(&layout_end, NULL);
+
+    if (perf >= 0) {
+        if (read(perf, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+        close(perf);
+    }
+    double elapsed = (layout_end.tv_sec - layout_start.tv_sec)
+            + (layout_end.tv_usec - layout_start.tv_usec) / 1000000.0;
+    printf("%s entries (%2u bytes): %.0lf entries/s, ", name,
+            (unsigned int) sizeof(typename R::entry_t), LAYOUT_ENTRIES / elapsed);
+    if (perf >= 0)
+        printf("%.3lf cache misses per entry\n", (double) misses / LAYOUT_ENTRIES);
+    else
+        printf("cache misses n/a\n");
+}
+
+// "performance sweep" runs only the entry processor sweep, "performance
+// layout" only the entry layout comparison
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "sweep")) {
+        consumer_sweep();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && !strcmp(argv[1], "layout")) {
+        layout_run<padded_ring_buffer_t>("padded");
+        layout_run<dense_ring_buffer_t>("dense ");
+        return EXIT_SUCCESS;
+    }
+
     double start_time;
     double end_time;
     const int num_threads = MAX_ENTRY_PROCESSORS;
     pthread_t thread_id[num_threads]; // consumer/entry processor
+    processor_arg_t args[num_threads];
     u64_ring_buffer_t::cursor_t cursor;
     u64_ring_buffer_t::entry_t *entry;
     uint_fast64_t reps;
@@ -114,8 +346,12 @@ int main(int argc, char *argv[])
     ////////////////////////////////////////////////////////////////////////////////////////
 
     //ring_buffer_init(&ring_buffer);
+    for(int i=0; i< num_threads; ++i) {
+        args[i].buffer = &ring_buffer;
+        args[i].first = ring_buffer.processor_barrier_register(args[i].reg_number);
+    }
     for(int i=0; i< num_threads; ++i)
-        if (!create_thread(&thread_id[i], &ring_buffer, entry_processor_thread)) {
+        if (!create_thread(&thread_id[i], &args[i], entry_processor_thread)) {
             printf("could not create entry processor thread\n");
             return EXIT_FAILURE;
         }
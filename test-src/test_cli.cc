@@ -1,42 +1,87 @@
 #include <iostream>       // std::cout
 #include <sstream>
 #include <set>
+#include <mutex>
 
 #include "workbit.h"
 
 using namespace std;
 
+static int unix_socket(const char* path, bool listening) {
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (listening) {
+    unlink(path);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, 1) < 0) {
+      close(s);
+      return -1;
+    }
+    int c = accept(s, NULL, NULL);
+    close(s);
+    unlink(path);
+    return c;
+  }
+  if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
 class testpeer : public workbit<testpeer> {
 public:
-  struct write_state_t {
-    void* buf;
-    size_t len;
-    list<pair<int,int> > fds; //fd,offset
-  };
-  struct mcast_state_t {
-    list<write_state_t> writeq;
-  };
-
   void* connection_accepted(int fd, struct sockaddr* addr) {
     cout << " accepted : " << fd << endl;
+    std::lock_guard<std::mutex> lock(_fds_lock);
     _fds.insert(fd);
-    return new mcast_state_t();
+    return NULL;
   }
   void* connection_made(int fd) {
     cout << " connected: " << fd << endl;
+    std::lock_guard<std::mutex> lock(_fds_lock);
     _fds.insert(fd);
-    return new mcast_state_t();
+    return NULL;
   }
   void connection_closed(const connection_t& conn) {
     cout << " lost     : " << conn.fd << endl;
+    std::lock_guard<std::mutex> lock(_fds_lock);
     _fds.erase(conn.fd);
-    delete (mcast_state_t*)(conn.extra);
   }
-  int readable(const connection_t& conn) {
-    _mcast_data(conn.fd, *(mcast_state_t*)conn.extra);
+  void timeout(const connection_t& conn) {
+    cout << " timeout  : " << conn.fd << endl;
   }
-  int writable(const connection_t& conn) {
-    _mcast_data(conn.fd, *(mcast_state_t*)conn.extra);
+  void connect_failed(int fd, int error) {
+    cout << " failed   : " << fd << " " << strerror(error) << endl;
+  }
+  // Reads into a pooled buffer and copies only what arrived into the one
+  // shared buffer handed to every other peer.
+  int readable(const connection_t& conn) {
+    int r;
+    do {
+      size_t len = 0;
+      void* in = allocate_buf(conn.fd, len);
+      if (in == NULL) {
+        cout << "no buffer \n";
+        return -1;
+      }
+      r = read(conn.fd, in, len);
+      if (r > 0 && _dump > 0) {
+        cout.write((char*)in, r);
+        cout << "\n";
+      } else if (r > 0) {
+        shared_buf_t* buf = shared_buf_t::create(r);
+        if (buf != NULL) {
+          memcpy(buf->data, in, r);
+          _mcast_data(conn.fd, buf);
+          buf->unref();
+        }
+      }
+      release_buf(conn.fd, in);
+    } while (r > 0);
+    return r;
   }
 
   int dump(int v) {
@@ -47,78 +92,45 @@ public:
   testpeer(): _dump(1) {}
 private:
   int _dump;
+  // every reactor adds and removes its own connections
+  std::mutex _fds_lock;
   set<int> _fds;
-  bool _should_resent(int r) {
-    return (r < 0) && ((errno == EAGAIN || errno == EWOULDBLOCK));
-  }
 
-  void _mcast_data(int srcfd, mcast_state_t& state) {
-    list<write_state_t>& q = state.writeq;
-    bool cont_loop = false;
-    while ( cont_loop && q.size() > 0) {
-      write_state_t& w = q.front();
-      list<pair<int, int> > l;
-      l.swap(w.fds);
-      for(pair<int, int> i: l) {
-        int r = write(i.first, (uint8_t*)w.buf + i.second, w.len - i.second);
-        if (_should_resent(r))
-          w.fds.push_back(i);
-      }
-      if (w.fds.size() > 0)
-        cont_loop = false;
-      else {
-        free(w.buf);
-        q.pop_front();
-      }
-    }
-    if (q.size() > 0)
-      return;
-
-    size_t len = 4096;
-    void * buf = malloc(len);
-    if (buf == NULL) {
-      cout << "malloc failed \n";
-      return;
-    }
-    int r = read(srcfd, buf, len);
-    while (r > 0) {
-      int wl = r;
-      if (_dump > 0) {
-        cout.write((char*)buf, r);
-        cout << "\n";
-        r = read(srcfd, buf, len);
-        continue;
-      }
-      write_state_t ws;
-      ws.buf = buf;
-      ws.len = wl;
-      for(int fd: _fds) {
-        if (fd == srcfd)
-          continue;
-        r = write(fd, buf, wl);
-        if (_should_resent(r)) {
-          ws.fds.push_back(pair<int,int>(fd, 0));
-        } else if (r == 0) {
-        }
-      }
-      if (ws.fds.size()> 0) {
-        state.writeq.push_back(ws);
-      }
-      r = read(srcfd, buf, len);
-    }
-    if (r == 0) {
-      _fds.erase(srcfd);
-    }
-    if (state.writeq.size() == 0) {
-      free(buf);
+  void _mcast_data(int srcfd, shared_buf_t* buf) {
+    std::lock_guard<std::mutex> lock(_fds_lock);
+    for (int fd: _fds) {
+      if (fd != srcfd)
+        request_shared(fd, buf);
     }
   }
 };
 
+static void unref_buf(void* parm, int fd, void* data) {
+  ((testpeer::shared_buf_t*)parm)->unref();
+}
+
 int main (int argc, char** argv)
 {
   testpeer wb;
-  wb.start();
+  const char* nreactors = getenv("OPGRID_REACTORS");
+  const char* spin = getenv("OPGRID_SPIN");
+  const char* connect_timeout = getenv("OPGRID_CONNECT_TIMEOUT");
+  if (spin || connect_timeout) {
+    testpeer::poll_opt_t opt;
+    if (spin)
+      opt.spin_budget = atoi(spin);
+    if (connect_timeout)
+      opt.connect_timeout_ms = atoi(connect_timeout);
+    wb.set_poll_opt(opt);
+  }
+  wb.start(nreactors ? atoi(nreactors) : 1);
+  // take the listeners of a predecessor running "handoff <path>"
+  const char* adopt = getenv("OPGRID_ADOPT");
+  if (adopt) {
+    int s = unix_socket(adopt, false);
+    cout << "adopt_listeners: " << wb.adopt_listeners(s) << endl;
+    close(s);
+  }
   if (argc == 2) {
     cout<<"prepare_listen : " << wb.prepare_listen("0.0.0.0", atoi(argv[1]))
         <<endl;
@@ -148,7 +160,97 @@ int main (int argc, char** argv)
       cout<<" send_retry: " << stat.send_retry
           <<", sent: " << stat.sent_bytes << "/" << stat.send_count 
           <<", recv: " << stat.recv_bytes << "/" << stat.recv_count 
+          <<", poll: " << stat.poll_events << "/" << stat.poll_calls
+          <<", bufs: " << stat.buf_hits << "/" << stat.buf_gets
+          <<" high " << stat.buf_high_water
           << "\n";
+      for (int i = 0; wb.reactors() > 1 && i < wb.reactors(); i++) {
+        stat = wb.get_stat(i);
+        cout<<"  reactor " << i
+            <<", sent: " << stat.sent_bytes << "/" << stat.send_count
+            <<", recv: " << stat.recv_bytes << "/" << stat.recv_count
+            << "\n";
+      }
+    } else if (cmd.find("send") == 0) {
+      // from this thread, so through the reactor's command queue
+      int fd = -1, n = 1;
+      string text;
+      stringstream ss(cmd.substr(5));
+      ss >> fd >> n >> text;
+      text += "\n";
+      int sent = 0;
+      for (int i = 0; i < n; i++) {
+        testpeer::shared_buf_t* buf = testpeer::shared_buf_t::create(text.size());
+        if (buf == NULL)
+          break;
+        memcpy(buf->data, text.data(), text.size());
+        int r;
+        // EAGAIN: the queue is full, give the reactor a moment
+        while ((r = wb.request_shared(fd, buf)) < 0 && errno == EAGAIN)
+          sched_yield();
+        if (r >= 0)
+          sent++;
+        buf->unref();
+      }
+      cout << "send: " << sent << "/" << n << endl;
+    } else if (cmd.find("peer") == 0) {
+      stringstream ss(cmd.substr(5));
+      string name, host;
+      int port;
+      testpeer::peer_opt_t opt;
+      ss >> name >> host >> port >> opt.connections;
+      cout << "add_peer: " << wb.add_peer(name.c_str(), host.c_str(), port, opt)
+           << endl;
+    } else if (cmd.find("psend") == 0) {
+      // like send, spread over the connections of a peer
+      int n = 1;
+      string name, text;
+      stringstream ss(cmd.substr(6));
+      ss >> name >> n >> text;
+      text += "\n";
+      int peer = wb.find_peer(name.c_str());
+      int sent = 0;
+      for (int i = 0; i < n; i++) {
+        testpeer::shared_buf_t* buf = testpeer::shared_buf_t::create(text.size());
+        if (buf == NULL)
+          break;
+        memcpy(buf->data, text.data(), text.size());
+        buf->ref();
+        int r;
+        while ((r = wb.peer_request(peer, buf->len, buf->data, unref_buf, buf)) < 0
+               && errno == ENOBUFS)
+          sched_yield();
+        if (r >= 0)
+          sent++;
+        else
+          buf->unref();
+        buf->unref();
+      }
+      cout << "psend: " << sent << "/" << n << endl;
+    } else if (cmd.find("pstat") == 0) {
+      testpeer::peer_stat_t ps;
+      if (wb.peer_stat(wb.find_peer(cmd.substr(6).c_str()), ps))
+        cout << " healthy: " << ps.healthy
+             << ", connects: " << ps.connects
+             << ", failures: " << ps.failures
+             << ", drops: " << ps.drops
+             << ", connect usec: " << ps.connect_usec
+             << " max " << ps.connect_usec_max << endl;
+    } else if (cmd.find("timer") == 0) {
+      int fd = -1, ms = -1;
+      stringstream ss(cmd.substr(6));
+      ss >> fd >> ms;
+      cout << "set_timer: " << wb.set_timer(fd, ms) << endl;
+    } else if (cmd.find("handoff") == 0) {
+      int s = unix_socket(cmd.substr(8).c_str(), true);
+      cout << "send_listeners: " << wb.send_listeners(s) << endl;
+      close(s);
+    } else if (cmd.find("drain") == 0) {
+      int ms = 1000;
+      stringstream ss(cmd.substr(5));
+      ss >> ms;
+      cout << "drain: " << wb.drain(ms) << endl;
+      break;
     } else if (cmd.find("dump") == 0) {
       int v = 0;
       stringstream ss(cmd.substr(5));
@@ -5,10 +5,37 @@
 
 using namespace std;
 
+// "0,2,4" -> {0, 2, 4}
+static vector<int> cpu_list(const char* s) {
+  vector<int> cpus;
+  stringstream ss(s ? s : "");
+  string cpu;
+  while (getline(ss, cpu, ','))
+    cpus.push_back(atoi(cpu.c_str()));
+  return cpus;
+}
+
 int main (int argc, char** argv)
 {
   opnode wb;
-  wb.start();
+  const char* processors = getenv("OPGRID_PROCESSORS");
+  if (processors && !wb.start_stage(atoi(processors), 1 << 20,
+                                    cpu_list(getenv("OPGRID_PROCESSOR_CPUS")))) {
+    cout << "cannot start processors" << endl;
+    return 1;
+  }
+  opnode::poll_opt_t opt;
+  opt.reactor_cpus = cpu_list(getenv("OPGRID_REACTOR_CPUS"));
+  wb.set_poll_opt(opt);
+  if (!wb.start()) {
+    cout << "cannot start reactors" << endl;
+    return 1;
+  }
+  int cpu, node;
+  for (int i = 0; wb.reactor_placement(i, cpu, node); i++)
+    cout << "reactor " << i << ": cpu " << cpu << ", node " << node << endl;
+  for (int i = 0; wb.processor_placement(i, cpu, node); i++)
+    cout << "processor " << i << ": cpu " << cpu << ", node " << node << endl;
   if (argc == 3) {
     cout << "prepare_listen: " << wb.prepare_listen(argv[1], atoi(argv[2]))
          << endl;
@@ -34,6 +61,7 @@ int main (int argc, char** argv)
     getline(cin, cmd);
   }
   wb.stop();
+  wb.stop_stage();
   return 0;
 }
 